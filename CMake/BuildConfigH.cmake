@@ -8,6 +8,7 @@ check_symbol_exists(getrusage sys/resource.h HAVE_GETRUSAGE)
 check_library_exists(readline readline "" HAVE_LIBREADLINE)
 check_library_exists(rt clock_gettime "" HAVE_LIBRT)
 check_include_file(netinet/in.h HAVE_NETINET_IN_H)
+check_include_file(pthread.h HAVE_PTHREAD_H)
 
 CHECK_CXX_SOURCE_COMPILES("
 template <bool x> struct static_assert;
@@ -107,5 +107,10 @@ arch_func_t arch_func_6502 = {
 	// idbg support
 	arch_6502_get_psr,
 	arch_6502_get_reg,
-	NULL
+	NULL,
+	// decoded instruction cache
+	NULL,
+	NULL,
+	// dead flag analysis
+	arch_6502_flags_instr
 };
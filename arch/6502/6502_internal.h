@@ -8,3 +8,4 @@ extern int         arch_6502_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t
 extern int         arch_6502_disasm_instr(cpu_t *cpu, addr_t pc, char *line, unsigned int max_line);
 extern Value      *arch_6502_translate_cond(cpu_t *cpu, addr_t pc, BasicBlock *bb);
 extern int         arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb);
+extern void        arch_6502_flags_instr(cpu_t *cpu, addr_t pc, uint32_t *read, uint32_t *written);
@@ -54,3 +54,83 @@ arch_6502_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *n
 	return length;
 }
 
+
+#define F(x) (1 << x##_SHIFT)
+#define F_ALL 0xFF
+
+/* the flags an instruction reads and writes, as translated */
+void
+arch_6502_flags_instr(cpu_t *cpu, addr_t pc, uint32_t *read, uint32_t *written)
+{
+	uint8_t opcode = cpu->RAM[pc];
+
+	*read = 0;
+	*written = 0;
+
+	switch (get_instr(opcode)) {
+		case INSTR_CLC:
+		case INSTR_SEC:
+			*written = F(C);
+			break;
+		case INSTR_CLD:
+		case INSTR_SED:
+			*written = F(D);
+			break;
+		case INSTR_CLI:
+		case INSTR_SEI:
+			*written = F(I);
+			break;
+		case INSTR_CLV:
+			*written = F(V);
+			break;
+
+		case INSTR_TAX: case INSTR_TAY: case INSTR_TXA: case INSTR_TYA:
+		case INSTR_TSX: case INSTR_TXS:
+		case INSTR_LDA: case INSTR_LDX: case INSTR_LDY: case INSTR_PLA:
+		case INSTR_AND: case INSTR_ORA: case INSTR_EOR: case INSTR_BIT:
+		case INSTR_INX: case INSTR_INY: case INSTR_DEX: case INSTR_DEY:
+		case INSTR_INC: case INSTR_DEC:
+			*written = F(N) | F(Z);
+			break;
+
+		case INSTR_ASL: case INSTR_LSR:
+		case INSTR_CMP: case INSTR_CPX: case INSTR_CPY:
+			*written = F(N) | F(Z) | F(C);
+			break;
+		case INSTR_ROL: case INSTR_ROR:
+			*read = F(C);
+			*written = F(N) | F(Z) | F(C);
+			break;
+		case INSTR_ADC: case INSTR_SBC:
+			*read = F(C);
+			*written = F(N) | F(Z) | F(C) | F(V);
+			break;
+
+		case INSTR_BEQ: case INSTR_BNE:
+			*read = F(Z);
+			break;
+		case INSTR_BCS: case INSTR_BCC:
+			*read = F(C);
+			break;
+		case INSTR_BMI: case INSTR_BPL:
+			*read = F(N);
+			break;
+		case INSTR_BVS: case INSTR_BVC:
+			*read = F(V);
+			break;
+
+		case INSTR_PLP:
+			*written = F_ALL;
+			break;
+
+		case INSTR_STA: case INSTR_STX: case INSTR_STY:
+		case INSTR_PHA: case INSTR_NOP:
+		case INSTR_JMP: case INSTR_JSR: case INSTR_RTS:
+			break;
+
+		/* PHP, and everything that traps to the client */
+		default:
+			*read = F_ALL;
+			break;
+	}
+}
@@ -9,6 +9,7 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "6502_isa.h"
+#include "6502_interface.h"
 #include "frontend.h"
 
 #include <inttypes.h>
@@ -26,6 +27,12 @@
 #define ptr_D cpu->ptr_FLAG[D_SHIFT]
 #define ptr_I cpu->ptr_FLAG[I_SHIFT]
 
+/* only set N and Z if anybody reads them */
+#undef SET_NZ
+#define SET_NZ(a) { Value *t = a; \
+	if (flag_is_live(cpu, pc, CPU_FLAGTYPE_NEGATIVE) || flag_is_live(cpu, pc, CPU_FLAGTYPE_ZERO)) \
+		arch_set_flags_result(cpu, t, "NZ", bb); }
+
 #define GEP(a) GetElementPtrInst::Create(cpu->ptr_RAM, a, "", bb)
 
 #define LOAD_RAM8(a) LOAD(GEP(a))
@@ -125,6 +132,19 @@ LOG("%s:%d pc=%" PRIx64 " opcode=%x\n", __func__, __LINE__, pc, opcode);
 #define LOPERAND arch_6502_get_operand_lvalue(cpu, pc, bb)
 #define OPERAND LOAD(LOPERAND)
 
+/*
+ * ADC and SBC (with the complement of the operand); V is only
+ * set if it is read before it is written again
+ */
+static Value *
+arch_6502_adc(cpu_t *cpu, addr_t pc, Value *v, BasicBlock *bb)
+{
+	if (!(cpu->info.arch_flags & CPU_6502_V_IGNORE) &&
+			flag_is_live(cpu, pc, CPU_FLAGTYPE_OVERFLOW))
+		return ADC(ptr_A, ptr_A, v, true, false, "CV");
+	return ADC(ptr_A, ptr_A, v, true, false, "C");
+}
+
 /* stack operations */
 #define TOS GEP(OR(ZEXT32(R(S)), CONST32(0x0100)))
 #define PUSH(v) { STORE(v, TOS); LET(S,DEC(R(S))); }
@@ -149,11 +169,11 @@ arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 
 	switch (get_instr(opcode)) {
 		/* flags */
-		case INSTR_CLC:	LET1(cpu->ptr_C, FALSE);				break;
+		case INSTR_CLC:	LET_FLAG(cpu->ptr_C, FALSE);				break;
 		case INSTR_CLD:	LET1(ptr_D, FALSE);				break;
 		case INSTR_CLI:	LET1(ptr_I, FALSE);				break;
-		case INSTR_CLV:	LET1(cpu->ptr_V, FALSE);				break;
-		case INSTR_SEC:	LET1(cpu->ptr_C, TRUE);				break;
+		case INSTR_CLV:	LET_FLAG(cpu->ptr_V, FALSE);				break;
+		case INSTR_SEC:	LET_FLAG(cpu->ptr_C, TRUE);			break;
 		case INSTR_SED:	LET1(ptr_D, TRUE);				break;
 		case INSTR_SEI:	LET1(ptr_I, TRUE);				break;
 
@@ -194,11 +214,11 @@ arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 		case INSTR_BIT:	SET_NZ(OPERAND);							break;
 
 		/* arithmetic */
-		case INSTR_ADC:	SET_NZ(ADC(ptr_A, ptr_A, OPERAND, true, false));		break;
-		case INSTR_SBC:	SET_NZ(ADC(ptr_A, ptr_A, COM(OPERAND), true, false));	break;
-		case INSTR_CMP:	SET_NZ(ADC(NULL, ptr_A, COM(OPERAND), false, true));		break;
-		case INSTR_CPX:	SET_NZ(ADC(NULL, ptr_X, COM(OPERAND), false, true));		break;
-		case INSTR_CPY:	SET_NZ(ADC(NULL, ptr_Y, COM(OPERAND), false, true));		break;
+		case INSTR_ADC:	SET_NZ(arch_6502_adc(cpu, pc, OPERAND, bb));		break;
+		case INSTR_SBC:	SET_NZ(arch_6502_adc(cpu, pc, COM(OPERAND), bb));	break;
+		case INSTR_CMP:	SET_NZ(ADC(NULL, ptr_A, COM(OPERAND), false, true, "C"));		break;
+		case INSTR_CPX:	SET_NZ(ADC(NULL, ptr_X, COM(OPERAND), false, true, "C"));		break;
+		case INSTR_CPY:	SET_NZ(ADC(NULL, ptr_Y, COM(OPERAND), false, true, "C"));		break;
 
 		/* increment/decrement */
 		case INSTR_INX:	SET_NZ(LET(X,INC(R(X))));			break;
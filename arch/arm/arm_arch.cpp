@@ -11,6 +11,15 @@
 #include "arm_internal.h"
 #include "frontend.h"
 
+static cpu_flags_layout_t arch_arm_flags_layout[] = {
+	{ N_SHIFT, CPU_FLAGTYPE_NEGATIVE, "N" },	/* negative */
+	{ Z_SHIFT, CPU_FLAGTYPE_ZERO, "Z" },	/* zero */
+	{ C_SHIFT, CPU_FLAGTYPE_CARRY, "C" },	/* carry */
+	{ V_SHIFT, CPU_FLAGTYPE_OVERFLOW, "V" },	/* overflow */
+	{ Q_SHIFT, 0, "Q" },	/* sticky overflow */
+	{ -1, 0, NULL }
+};
+
 static void
 arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 {
@@ -31,6 +40,9 @@ arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 64;
 	info->address_size = 32;
+	info->psr_size = 32;
+	// Instructions are 32bits and aligned.
+	info->instruction_align = 4;
 	// There are 16 32-bit GPRs
 	info->register_count[CPU_REG_GPR] = 16;
 	info->register_size[CPU_REG_GPR] = info->word_size;
@@ -38,6 +50,9 @@ arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->register_count[CPU_REG_XR] = 1;
 	info->register_size[CPU_REG_XR] = 32;
 
+	info->flags_count = 5;
+	info->flags_layout = arch_arm_flags_layout;
+
 	reg_arm_t *reg;
 	reg = (reg_arm_t*)malloc(sizeof(reg_arm_t));
 	for (int i=0; i<17; i++) /* this includes pc */
@@ -45,16 +60,11 @@ arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 
 	cpu->rf.pc = &reg->r[15];
 	cpu->rf.grf = reg;
-
-	// allocate space for CC flags.
-	cpu->feptr = malloc(sizeof(ccarm_t));
-	assert(cpu->feptr != NULL);
 }
 
 static void
 arch_arm_done(cpu_t *cpu)
 {
-	free(cpu->feptr);
 	free(cpu->rf.grf);
 }
 
@@ -84,8 +94,8 @@ arch_func_t arch_func_arm = {
 	arch_arm_init,
 	arch_arm_done,
 	arch_arm_get_pc,
-	arch_arm_emit_decode_reg,
-	arch_arm_spill_reg_state,
+	NULL,
+	NULL,
 	arch_arm_tag_instr,
 	arch_arm_disasm_instr,
 	arch_arm_translate_cond,
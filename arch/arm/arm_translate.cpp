@@ -17,13 +17,6 @@
 
 using namespace llvm;
 
-#define ptr_N			((ccarm_t*)cpu->feptr)->ptr_N
-#define ptr_Z			((ccarm_t*)cpu->feptr)->ptr_Z
-#define ptr_C			((ccarm_t*)cpu->feptr)->ptr_C
-#define ptr_V			((ccarm_t*)cpu->feptr)->ptr_V
-#define ptr_I			((ccarm_t*)cpu->feptr)->ptr_I
-#define ptr_CPSR	cpu->ptr_xr[0]
-
 #define BAD do { printf("%s:%d\n", __func__, __LINE__); exit(1); } while(0)
 #define LOGX do { LOG("%s:%d\n", __func__, __LINE__); } while(0)
 
@@ -98,33 +91,33 @@ Value *
 arch_arm_translate_cond(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 	switch (*(uint32_t*)&cpu->RAM[pc] >> 28) {
 		case 0x0: /* EQ */
-			return LOAD(ptr_Z);
+			return CC_EQ;
 		case 0x1: /* NE */
-			return NOT(LOAD(ptr_Z));
+			return CC_NE;
 		case 0x2: /* CS */
-			return LOAD(ptr_C);
+			return CC_CS;
 		case 0x3: /* CC */
-			return NOT(LOAD(ptr_C));
+			return CC_CC;
 		case 0x4: /* MI */
-			return LOAD(ptr_N);
+			return CC_MI;
 		case 0x5: /* PL */
-			return NOT(LOAD(ptr_N));
+			return CC_PL;
 		case 0x6: /* VS */
-			return LOAD(ptr_V);
+			return CC_VS;
 		case 0x7: /* VC */
-			return NOT(LOAD(ptr_V));
+			return CC_VC;
 		case 0x8: /* HI */
-			return AND(LOAD(ptr_C),NOT(LOAD(ptr_Z)));
+			return AND(CC_CS,CC_NE);
 		case 0x9: /* LS */
-			return NOT(AND(LOAD(ptr_C),NOT(LOAD(ptr_Z))));
+			return NOT(AND(CC_CS,CC_NE));
 		case 0xA: /* GE */
-			return ICMP_EQ(LOAD(ptr_N),LOAD(ptr_V));
+			return ICMP_EQ(CC_MI,CC_VS);
 		case 0xB: /* LT */
-			return NOT(ICMP_EQ(LOAD(ptr_N),LOAD(ptr_V)));
+			return NOT(ICMP_EQ(CC_MI,CC_VS));
 		case 0xC: /* GT */
-			return AND(NOT(LOAD(ptr_Z)),ICMP_EQ(LOAD(ptr_N),LOAD(ptr_V)));
+			return AND(CC_NE,ICMP_EQ(CC_MI,CC_VS));
 		case 0xD: /* LE */
-			return NOT(AND(NOT(LOAD(ptr_Z)),ICMP_EQ(LOAD(ptr_N),LOAD(ptr_V))));
+			return NOT(AND(CC_NE,ICMP_EQ(CC_MI,CC_VS)));
 		case 0xE: /* AL */
 			return NULL; /* no condition; this should never happen */
 		case 0xF: /* NV */
@@ -166,25 +159,16 @@ Value *operand(cpu_t *cpu, addr_t pc, BasicBlock *bb)
 #define OPERAND operand(cpu,pc,bb)
 
 
-static void
+/* op1 - op2 is op1 + ~op2 + 1; C is "no borrow" */
+static Value *
 setsub(cpu_t *cpu, Value *op1, Value *op2, BasicBlock *bb)
 {
-	Value *v = BinaryOperator::Create(Instruction::Sub, op1, op2, "", bb);
-	/* Z */	new StoreInst(ICMP_EQ(v, CONST(0)), ptr_Z, bb);
-	/* N */	new StoreInst(ICMP_SLT(v, CONST(0)), ptr_N, bb);
-	/* C */	new StoreInst(ICMP_SLE(v, op1), ptr_C, false, bb);
-	/* V */	new StoreInst(TRUNC1(LSHR(AND(XOR(op1, op2),XOR(op1,v)),CONST(31))), ptr_V, false, bb);
-	return;
+	Value *v = SUB(op1, op2);
+	SET_NZ(v);
+	SET_CV_ADD(op1, COM(op2), TRUE);
+	return v;
 }
 
-#define LET1(a,b) new StoreInst(b, a, false, bb)
-
-#undef SET_NZ
-#define SET_NZ(a) { Value *t = a; LET1(ptr_Z, ICMP_EQ(t, CONST(0))); LET1(ptr_N, ICMP_SLT(t, CONST(0))); }
-
-#define COMPUTE_CARRY(src1, src2, result) \
-	(AND(ICMP_NE(src2, CONST(0)), ICMP_ULT(result, src1)))
-
 #define LINK LET32(14, CONST((uint64_t)(int64_t)(int32_t)pc+8))
 
 int arch_arm_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
@@ -203,17 +187,14 @@ LOG("%s:%d pc=%" PRIx64 "\n", __func__, __LINE__, pc);
 	switch ((instr >> 26) & 3) { /* bits 26 and 27 */
 		case 0:
 			switch(opcode) {
-				case 2:
+				case 2: /* SUB */
 					{
 						Value *op1 = R(RN);
 						Value *op2 = OPERAND;
-						Value *res = SUB(op1,op2);
+						Value *res = S ? setsub(cpu, op1, op2, bb) : SUB(op1,op2);
 						LET(RD, res);
-						if (S) {
-							BAD;
-							//XXX TODO overflow!
-						}
 					}
+					break;
 				case 4: /* ADD */
 					{
 						Value *op1 = R(RN);
@@ -222,9 +203,7 @@ LOG("%s:%d pc=%" PRIx64 "\n", __func__, __LINE__, pc);
 						LET(RD, res);
 						if (S) {
 							SET_NZ(res);
-							LET1(ptr_C, COMPUTE_CARRY(op1, op2, res));
-							BAD;
-							//XXX TODO overflow!
+							SET_CV_ADD(op1, op2, FALSE);
 						}
 					}
 					break;
@@ -296,56 +275,5 @@ LOG("%s:%d pc=%" PRIx64 "\n", __func__, __LINE__, pc);
 	return 4;
 }
 
-#define N_SHIFT 31
-#define Z_SHIFT 30
-#define C_SHIFT 29
-#define V_SHIFT 28
-#define I_SHIFT 27
-
-static Value *
-arch_arm_flags_encode(cpu_t *cpu, BasicBlock *bb)
-{
-	Value *flags = ConstantInt::get(getIntegerType(32), 0);
-
-	flags = arch_encode_bit(flags, ptr_N, N_SHIFT, 32, bb);
-	flags = arch_encode_bit(flags, ptr_Z, Z_SHIFT, 32, bb);
-	flags = arch_encode_bit(flags, ptr_C, C_SHIFT, 32, bb);
-	flags = arch_encode_bit(flags, ptr_V, V_SHIFT, 32, bb);
-	flags = arch_encode_bit(flags, ptr_I, I_SHIFT, 32, bb);
-
-	return flags;
-}
-
-static void
-arch_arm_flags_decode(cpu_t *cpu, Value *flags, BasicBlock *bb)
-{
-	arch_decode_bit(flags, ptr_N, N_SHIFT, 32, bb);
-	arch_decode_bit(flags, ptr_Z, Z_SHIFT, 32, bb);
-	arch_decode_bit(flags, ptr_C, C_SHIFT, 32, bb);
-	arch_decode_bit(flags, ptr_V, V_SHIFT, 32, bb);
-	arch_decode_bit(flags, ptr_I, I_SHIFT, 32, bb);
-}
-
-void
-arch_arm_emit_decode_reg(cpu_t *cpu, BasicBlock *bb)
-{
-	// declare flags
-	ptr_N = new AllocaInst(getIntegerType(1), "N", bb);
-	ptr_Z = new AllocaInst(getIntegerType(1), "Z", bb);
-	ptr_C = new AllocaInst(getIntegerType(1), "C", bb);
-	ptr_V = new AllocaInst(getIntegerType(1), "V", bb);
-	ptr_I = new AllocaInst(getIntegerType(1), "I", bb);
-
-	// decode CPSR
-	Value *flags = new LoadInst(ptr_CPSR, "", false, bb);
-	arch_arm_flags_decode(cpu, flags, bb);
-}
-
-void
-arch_arm_spill_reg_state(cpu_t *cpu, BasicBlock *bb)
-{
-	Value *flags = arch_arm_flags_encode(cpu, bb);
-	new StoreInst(flags, ptr_CPSR, false, bb);
-}
 //printf("%s:%d PC=$%04X\n", __func__, __LINE__, pc);
 //printf("%s:%d\n", __func__, __LINE__);
@@ -30,10 +30,9 @@ typedef struct {
 	uint32_t pc;
 } reg_arm_t;
 
-typedef struct {
-	Value* ptr_N;
-	Value* ptr_Z;
-	Value* ptr_C;
-	Value* ptr_V;
-	Value* ptr_I;
-} ccarm_t;
+/* flags in CPSR */
+#define N_SHIFT 31
+#define Z_SHIFT 30
+#define C_SHIFT 29
+#define V_SHIFT 28
+#define Q_SHIFT 27
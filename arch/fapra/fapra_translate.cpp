@@ -1,7 +1,5 @@
 #include "llvm/IR/Instructions.h"
 
-#define OPT_LOCAL_REGISTERS //XXX
-
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "frontend.h"
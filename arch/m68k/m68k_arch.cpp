@@ -20,6 +20,8 @@ arch_m68k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 80;
 	info->address_size = 32;
+	// Instructions are aligned to 16bits.
+	info->instruction_align = 2;
 	// Page size is 4K or 8K, default is 8K.
 	info->min_page_size = 4096;
 	info->max_page_size = 8192;
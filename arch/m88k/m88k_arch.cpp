@@ -38,6 +38,8 @@ arch_m88k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 80;
 	info->address_size = 32;
+	// Instructions are 32bits and aligned.
+	info->instruction_align = 4;
 	// Page size is just 4K.
 	info->min_page_size = 4096;
 	info->max_page_size = 4096;
@@ -31,6 +31,8 @@ arch_mips_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 		info->word_size = 32;
 		info->address_size = 32;
 	}
+	// Instructions are 32bits and aligned.
+	info->instruction_align = 4;
 	// Page size is 4K or 16M
 	info->min_page_size = 4096;
 	info->max_page_size = 16777216;
@@ -10,6 +10,7 @@
 #include "libcpu.h"
 #include "x86_isa.h"
 #include "x86_decode.h"
+#include "x86_internal.h"
 
 static const char* mnemo[] = {
 #define DECLARE_INSTR(name,str) str,
@@ -134,28 +135,28 @@ print_operand(addr_t pc, char *operands, size_t size, struct x86_instr *instr, s
 int
 arch_8086_disasm_instr(cpu_t *cpu, addr_t pc, char *line, unsigned int max_line)
 {
-	struct x86_instr instr;
+	struct x86_instr buf, *instr;
 	char operands[32];
 	int len = 0;
 
-	if (arch_8086_decode_instr(&instr, cpu->RAM, pc) != 0) {
-		fprintf(stderr, "error: unable to decode opcode %x\n", instr.opcode);
+	if ((instr = arch_8086_get_instr(cpu, pc, &buf)) == NULL) {
+		fprintf(stderr, "error: unable to decode opcode %x\n", buf.opcode);
 		exit(1);
 	}
 
 	operands[0] = '\0';
 
 	/* AT&T syntax operands */
-	if (!(instr.flags & SRC_NONE))
-		len += print_operand(pc, operands+len, sizeof(operands)-len, &instr, &instr.src);
+	if (!(instr->flags & SRC_NONE))
+		len += print_operand(pc, operands+len, sizeof(operands)-len, instr, &instr->src);
 
-	if (!(instr.flags & SRC_NONE) && !(instr.flags & DST_NONE))
+	if (!(instr->flags & SRC_NONE) && !(instr->flags & DST_NONE))
 		len += snprintf(operands+len, sizeof(operands)-len, ",");
 
-	if (!(instr.flags & DST_NONE))
-		len += print_operand(pc, operands+len, sizeof(operands)-len, &instr, &instr.dst);
+	if (!(instr->flags & DST_NONE))
+		len += print_operand(pc, operands+len, sizeof(operands)-len, instr, &instr->dst);
 
-        snprintf(line, max_line, "%s%s%s\t%s", lock_names[instr.lock_prefix], prefix_names[instr.rep_prefix], to_mnemonic(&instr), operands);
+        snprintf(line, max_line, "%s%s%s\t%s", lock_names[instr->lock_prefix], prefix_names[instr->rep_prefix], to_mnemonic(instr), operands);
 
-        return arch_8086_instr_length(&instr);
+        return arch_8086_instr_length(instr);
 }
@@ -4,6 +4,9 @@
  * prototypes of functions exported to core
  */
 
+extern void       *arch_8086_decode(cpu_t *cpu, addr_t pc);
+extern void        arch_8086_free_decoded(cpu_t *cpu, void *decoded);
+extern struct x86_instr *arch_8086_get_instr(cpu_t *cpu, addr_t pc, struct x86_instr *buf);
 extern int         arch_8086_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *next_pc);
 extern int         arch_8086_disasm_instr(cpu_t *cpu, addr_t pc, char *line, unsigned int max_line);
 extern Value      *arch_8086_translate_cond(cpu_t *cpu, addr_t pc, BasicBlock *bb);
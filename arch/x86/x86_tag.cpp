@@ -6,19 +6,52 @@
 
 #include "libcpu.h"
 #include "x86_decode.h"
+#include "x86_internal.h"
 #include "x86_isa.h"
 #include "tag.h"
 
+/* decoded instruction cache hooks */
+void *
+arch_8086_decode(cpu_t *cpu, addr_t pc)
+{
+	struct x86_instr *instr = (struct x86_instr *)malloc(sizeof(struct x86_instr));
+
+	if (instr != NULL && arch_8086_decode_instr(instr, cpu->RAM, pc) != 0) {
+		free(instr);
+		return NULL;
+	}
+	return instr;
+}
+
+void
+arch_8086_free_decoded(cpu_t *cpu, void *decoded)
+{
+	free(decoded);
+}
+
+/* decode the instruction at 'pc', from the cache if possible */
+struct x86_instr *
+arch_8086_get_instr(cpu_t *cpu, addr_t pc, struct x86_instr *buf)
+{
+	struct x86_instr *instr = (struct x86_instr *)get_decoded_instr(cpu, pc);
+
+	if (instr != NULL)
+		return instr;
+	if (arch_8086_decode_instr(buf, cpu->RAM, pc) != 0)
+		return NULL;
+	return buf;
+}
+
 int
 arch_8086_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *next_pc)
 {
-	struct x86_instr instr;
+	struct x86_instr buf, *instr;
 	int len;
 
-	if (arch_8086_decode_instr(&instr, cpu->RAM, pc) != 0)
+	if ((instr = arch_8086_get_instr(cpu, pc, &buf)) == NULL)
 		return -1;
 
-	len = arch_8086_instr_length(&instr);
+	len = arch_8086_instr_length(instr);
 
 	if (cpu->RAM[pc] == 0xCD && cpu->RAM[pc+1] == 0x20) {
 		//XXX DOS-specific hack to end tagging when an "int $0x20" is encountered
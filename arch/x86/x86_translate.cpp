@@ -109,5 +109,8 @@ arch_func_t arch_func_8086 = {
 	// idbg support
 	arch_8086_get_psr,
 	arch_8086_get_reg,
-	NULL
+	NULL,
+	// decoded instruction cache
+	arch_8086_decode,
+	arch_8086_free_decoded
 };
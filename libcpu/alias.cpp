@@ -0,0 +1,70 @@
+/*
+ * libcpu: alias.cpp
+ *
+ * Tell LLVM which memory accesses of a unit can't alias. jitmain's
+ * RAM, grf and frf arguments are noalias (see function.cpp), and
+ * once a unit has been translated, every load and store of guest
+ * RAM, the register files and the PC gets a TBAA tag of its own.
+ * A PC that is a general purpose register (r15 on ARM) is accessed
+ * through grf, and gets grf's tag like the other registers.
+ * A store to guest memory then doesn't force registers that have
+ * been loaded already to be loaded again, and the other way round.
+ * Flags and the PC live in locals until they are written back.
+ */
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "pc.h"
+#include "alias.h"
+
+void
+alias_annotate(cpu_t *cpu, Function *f)
+{
+	MDBuilder mdb(_CTX());
+	MDNode *root = mdb.createTBAARoot("libcpu");
+	MDNode *tbaa_ram = mdb.createTBAANode("ram", root);
+	MDNode *tbaa_gpr = mdb.createTBAANode("grf", root);
+	MDNode *tbaa_fpr = mdb.createTBAANode("frf", root);
+	MDNode *tbaa_pc = mdb.createTBAANode("pc", root);
+	const DataLayout *dl = cpu->exec_engine->getDataLayout();
+	uintptr_t pc_offset;
+	bool pc_own = !pc_in_grf(cpu, &pc_offset);
+
+	for (Function::iterator bb = f->begin(); bb != f->end(); bb++) {
+		for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); inst++) {
+			Value *ptr;
+			MDNode *tag;
+
+			if (LoadInst *load = dyn_cast<LoadInst>(inst))
+				ptr = load->getPointerOperand();
+			else if (StoreInst *store = dyn_cast<StoreInst>(inst))
+				ptr = store->getPointerOperand();
+			else
+				continue;
+
+			/* the PC is a field of the client's register set */
+			if (pc_own && ptr == cpu->in_ptr_PC) {
+				inst->setMetadata(LLVMContext::MD_tbaa, tbaa_pc);
+				continue;
+			}
+
+			ptr = GetUnderlyingObject(ptr, dl);
+			if (ptr == cpu->ptr_RAM)
+				tag = tbaa_ram;
+			else if (ptr == cpu->ptr_grf)
+				tag = tbaa_gpr;
+			else if (ptr == cpu->ptr_frf)
+				tag = tbaa_fpr;
+			else
+				continue;
+			inst->setMetadata(LLVMContext::MD_tbaa, tag);
+		}
+	}
+}
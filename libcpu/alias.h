@@ -0,0 +1 @@
+void alias_annotate(cpu_t *cpu, Function *f);
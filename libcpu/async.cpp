@@ -0,0 +1,351 @@
+/*
+ * libcpu: async.cpp
+ *
+ * Background optimization (CPU_CODEGEN_BACKGROUND). New code is
+ * translated and compiled right away without optimizations, so
+ * cpu_run() never waits for the optimizer. The units that are
+ * worth optimizing are translated again by the main thread, and
+ * the compile thread runs the optimizer and the code generator
+ * over them. It has an LLVM context, module and JIT of its own,
+ * which the IR gets into as bitcode, so the main thread can go on
+ * translating meanwhile.
+ *
+ * Everything else (tags, the code cache, link slots) belongs to
+ * the main thread alone; the lock only protects the job queues,
+ * and is never held while LLVM works. cpu_run() installs the
+ * finished units in place of the ones they replace, whose loops
+ * leave them once the new code is ready, see profile.cpp.
+ */
+#include <assert.h>
+#include <deque>
+#include <string>
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "libcpu.h"
+#include "optimize.h"
+#include "async.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+struct async_state {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work; // jobs or garbage queued, or stop requested
+	std::deque<async_job_t *> queue;
+	async_job_t *current; // being compiled right now
+	std::vector<async_job_t *> compiled; // waiting to be installed
+	std::vector<Function *> garbage; // code of freed units
+	bool stop;
+};
+
+bool
+async_enabled(cpu_t *cpu)
+{
+	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))
+		return false;
+	/* there's nothing else to do in the background */
+	if (!(cpu->flags_codegen & CPU_CODEGEN_OPTIMIZE))
+		return false;
+	return !!(cpu->flags_codegen & CPU_CODEGEN_BACKGROUND);
+}
+
+/* the compile thread's JIT tells it how much code a job became */
+class JobSizeListener : public JITEventListener {
+public:
+	size_t size;
+
+	virtual void NotifyFunctionEmitted(const Function &F, void *Code,
+		size_t Size, const EmittedFunctionDetails &Details)
+	{
+		size = Size;
+	}
+};
+
+/* every job has a module of its own */
+static void
+free_function(ExecutionEngine *engine, Function *func)
+{
+	if (func == NULL)
+		return;
+
+	Module *mod = func->getParent();
+	engine->freeMachineCodeForFunction(func);
+	engine->removeModule(mod);
+	delete mod;
+}
+
+static void
+compile_job(ExecutionEngine *engine, LLVMContext &context,
+	JobSizeListener &listener, async_job_t *job)
+{
+	MemoryBuffer *buffer = MemoryBuffer::getMemBuffer(job->bitcode, "", false);
+	std::string error;
+	Module *mod = ParseBitcodeFile(buffer, context, &error);
+
+	delete buffer;
+	if (mod == NULL) {
+		printf("cannot read back translated code: %s\n", error.c_str());
+		exit(1);
+	}
+	std::string().swap(job->bitcode);
+	engine->addModule(mod);
+
+	/* the unit, next to the intrinsics it uses */
+	job->func = NULL;
+	for (Module::iterator it = mod->begin(); it != mod->end(); it++)
+		if (!it->isDeclaration())
+			job->func = it;
+	assert(job->func != NULL);
+
+	job->opt_time = 0;
+	if (job->pipeline != NULL)
+		job->opt_time = optimize_function(job->pipeline, job->func,
+			engine->getDataLayout());
+	if (job->dump)
+		mod->dump();
+
+	listener.size = 0;
+	job->fp = engine->getPointerToFunction(job->func);
+	job->code_size = listener.size;
+}
+
+static void *
+async_thread(void *arg)
+{
+	cpu_t *cpu = (cpu_t *)arg;
+	async_state_t *as = cpu->async;
+	LLVMContext context;
+	ExecutionEngine *engine = ExecutionEngine::create(new Module("async", context));
+	JobSizeListener listener;
+
+	assert(engine != NULL);
+	engine->RegisterJITEventListener(&listener);
+
+	pthread_mutex_lock(&as->lock);
+	for (;;) {
+		for (size_t i = 0; i < as->garbage.size(); i++)
+			free_function(engine, as->garbage[i]);
+		as->garbage.clear();
+
+		if (as->stop)
+			break;
+		if (as->queue.empty()) {
+			pthread_cond_wait(&as->work, &as->lock);
+			continue;
+		}
+		async_job_t *job = as->queue.front();
+		as->queue.pop_front();
+		as->current = job;
+
+		pthread_mutex_unlock(&as->lock);
+		compile_job(engine, context, listener, job);
+		pthread_mutex_lock(&as->lock);
+
+		as->current = NULL;
+		if (job->cancelled) {
+			free_function(engine, job->func);
+			delete job;
+			continue;
+		}
+		/* the old unit's loops may leave it now, see profile.cpp */
+		job->old->leave = 1;
+		as->compiled.push_back(job);
+	}
+	pthread_mutex_unlock(&as->lock);
+
+	/* this frees the code of all units it has compiled */
+	engine->UnregisterJITEventListener(&listener);
+	delete engine;
+	return NULL;
+}
+
+void
+async_start(cpu_t *cpu)
+{
+	async_state_t *as;
+
+	if (cpu->async != NULL)
+		return;
+
+	/* two threads are going to use LLVM */
+	llvm_start_multithreaded();
+
+	as = new async_state_t;
+	pthread_mutex_init(&as->lock, NULL);
+	pthread_cond_init(&as->work, NULL);
+	as->current = NULL;
+	as->stop = false;
+	cpu->async = as;
+
+	if (pthread_create(&as->thread, NULL, async_thread, cpu) != 0) {
+		printf("cannot create compile thread\n");
+		exit(1);
+	}
+}
+
+/*
+ * Queued jobs are dropped, and the code of the units the thread
+ * has compiled goes with it: only for cpu_free().
+ */
+void
+async_stop(cpu_t *cpu)
+{
+	async_state_t *as = cpu->async;
+
+	if (as == NULL)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+	as->stop = true;
+	pthread_cond_signal(&as->work);
+	pthread_mutex_unlock(&as->lock);
+	pthread_join(as->thread, NULL);
+
+	for (std::deque<async_job_t *>::const_iterator it = as->queue.begin(); it != as->queue.end(); it++)
+		delete *it;
+	for (std::vector<async_job_t *>::const_iterator it = as->compiled.begin(); it != as->compiled.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&as->work);
+	pthread_mutex_destroy(&as->lock);
+	delete as;
+	cpu->async = NULL;
+}
+
+/*
+ * Queue a job for the compile thread; 'mod' holds nothing but the
+ * job's unit, and is freed once it has been written as bitcode.
+ */
+void
+async_queue(cpu_t *cpu, async_job_t *job, Module *mod)
+{
+	async_state_t *as = cpu->async;
+	raw_string_ostream os(job->bitcode);
+
+	WriteBitcodeToFile(mod, os);
+	os.flush();
+	delete mod;
+
+	job->cancelled = false;
+	job->func = NULL;
+	job->fp = NULL;
+	job->code_size = 0;
+	job->opt_time = 0;
+
+	pthread_mutex_lock(&as->lock);
+	as->queue.push_back(job);
+	pthread_cond_signal(&as->work);
+	pthread_mutex_unlock(&as->lock);
+}
+
+/* the finished jobs, for cpu_run() to install */
+void
+async_take_compiled(cpu_t *cpu, std::vector<async_job_t *> &jobs)
+{
+	async_state_t *as = cpu->async;
+
+	if (as == NULL)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+	jobs.swap(as->compiled);
+	pthread_mutex_unlock(&as->lock);
+}
+
+/* a compiled job that won't be installed; the caller holds the lock */
+static void
+drop_compiled(async_state_t *as, async_job_t *job)
+{
+	as->garbage.push_back(job->func);
+	delete job;
+}
+
+/* the pending unit is being freed: its job, if any, goes too */
+void
+async_forget_unit(cpu_t *cpu, cpu_unit_t *unit)
+{
+	async_state_t *as = cpu->async;
+
+	if (as == NULL)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+	for (std::deque<async_job_t *>::iterator it = as->queue.begin(); it != as->queue.end(); it++) {
+		if ((*it)->unit == unit) {
+			delete *it;
+			as->queue.erase(it);
+			break;
+		}
+	}
+	if (as->current != NULL && as->current->unit == unit)
+		as->current->cancelled = true;
+	for (std::vector<async_job_t *>::iterator it = as->compiled.begin(); it != as->compiled.end(); it++) {
+		if ((*it)->unit == unit) {
+			drop_compiled(as, *it);
+			as->compiled.erase(it);
+			pthread_cond_signal(&as->work);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&as->lock);
+}
+
+void
+async_forget_all(cpu_t *cpu)
+{
+	async_state_t *as = cpu->async;
+
+	if (as == NULL)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+	for (std::deque<async_job_t *>::const_iterator it = as->queue.begin(); it != as->queue.end(); it++)
+		delete *it;
+	as->queue.clear();
+	if (as->current != NULL)
+		as->current->cancelled = true;
+	for (std::vector<async_job_t *>::const_iterator it = as->compiled.begin(); it != as->compiled.end(); it++)
+		drop_compiled(as, *it);
+	as->compiled.clear();
+	pthread_cond_signal(&as->work);
+	pthread_mutex_unlock(&as->lock);
+}
+
+/* free the code of a unit the compile thread has compiled */
+void
+async_free_code(cpu_t *cpu, Function *func)
+{
+	async_state_t *as = cpu->async;
+
+	/* without the thread, its JIT and the code are gone already */
+	if (as == NULL || func == NULL)
+		return;
+
+	pthread_mutex_lock(&as->lock);
+	as->garbage.push_back(func);
+	pthread_cond_signal(&as->work);
+	pthread_mutex_unlock(&as->lock);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+bool async_enabled(cpu_t *cpu) { return false; }
+void async_start(cpu_t *cpu) {}
+void async_stop(cpu_t *cpu) {}
+void async_queue(cpu_t *cpu, async_job_t *job, Module *mod) { assert(0); }
+void async_take_compiled(cpu_t *cpu, std::vector<async_job_t *> &jobs) {}
+void async_forget_unit(cpu_t *cpu, cpu_unit_t *unit) {}
+void async_forget_all(cpu_t *cpu) {}
+void async_free_code(cpu_t *cpu, Function *func) {}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,24 @@
+/* a unit translated by the main thread, for the compile thread */
+typedef struct async_job {
+	cpu_unit_t *unit;   // pending: not installed before the job is done
+	cpu_unit_t *old;    // the running unit it is going to replace
+	addr_list entries;  // the entries of 'unit'
+	int level;          // optimization level, -1: none
+	opt_pipeline_t *pipeline; // of 'level'
+	bool dump;          // print the optimized IR
+	std::string bitcode; // of the module 'unit' has been translated into
+	bool cancelled;     // 'unit' has been freed while it was compiled
+	Function *func;     // in the compile thread's module
+	void *fp;
+	size_t code_size;
+	uint64_t opt_time;
+} async_job_t;
+
+bool async_enabled(cpu_t *cpu);
+void async_start(cpu_t *cpu);
+void async_stop(cpu_t *cpu);
+void async_queue(cpu_t *cpu, async_job_t *job, Module *mod);
+void async_take_compiled(cpu_t *cpu, std::vector<async_job_t *> &jobs);
+void async_forget_unit(cpu_t *cpu, cpu_unit_t *unit);
+void async_forget_all(cpu_t *cpu);
+void async_free_code(cpu_t *cpu, Function *func);
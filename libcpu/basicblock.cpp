@@ -12,6 +12,7 @@
 #include "libcpu_llvm.h"
 #include "basicblock.h"
 #include "tag.h"
+#include "link.h"
 
 #include <inttypes.h>
 
@@ -19,13 +20,7 @@ bool
 is_start_of_basicblock(cpu_t *cpu, addr_t a)
 {
 	tag_t tag = get_tag(cpu, a);
-	return (tag &
-		(TAG_BRANCH_TARGET |	/* someone jumps/branches here */
-		 TAG_SUBROUTINE |		/* someone calls this */
-		 TAG_AFTER_CALL |		/* instruction after a call */
-		 TAG_AFTER_COND |		/* instruction after a branch */
-		 TAG_AFTER_TRAP |		/* instruction after a trap */
-		 TAG_ENTRY))			/* client wants to enter guest code here */
+	return (tag & TAG_BASICBLOCK_START)
 		&& (tag & TAG_CODE);	/* only if we actually tagged it */
 }
 
@@ -65,9 +60,13 @@ lookup_basicblock(cpu_t *cpu, Function* f, addr_t pc, BasicBlock *bb_ret, uint8_
 	if (i != bb_addr.end())
 		return i->second;
 
-	LOG("basic block %c%08" PRIx64 " not found in function %p - creating return basic block!\n", bb_type, pc, f);
+	LOG("basic block %c%08" PRIx64 " not found in function %p - creating link basic block!\n", bb_type, pc, f);
 	BasicBlock *new_bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_EXTERNAL);
-	emit_store_pc_return(cpu, new_bb, pc, bb_ret);
+	if (cpu->bb_link != NULL) {
+		emit_store_pc(cpu, new_bb, pc);
+		emit_link(cpu, new_bb, pc, bb_ret);
+	} else
+		emit_store_pc_return(cpu, new_bb, pc, bb_ret);
 
 	return new_bb;
 }
@@ -2,7 +2,12 @@ enum {
 	BB_TYPE_NORMAL   = 'L', /* basic block for instructions */
 	BB_TYPE_COND     = 'C', /* basic block for "taken" case of cond. execution */
 	BB_TYPE_DELAY    = 'D', /* basic block for delay slot in non-taken case of cond. exec. */
-	BB_TYPE_EXTERNAL = 'E'  /* basic block for unknown addresses; just traps */
+	BB_TYPE_INDIRECT = 'I', /* basic block for target cache of a computed branch */
+	BB_TYPE_RETURN   = 'R', /* basic block for return prediction */
+	BB_TYPE_SMC      = 'W', /* basic block for leaving after a write to code */
+	BB_TYPE_TRACE    = 'T', /* copy of a basic block along a hot trace */
+	BB_TYPE_CALL     = 'H', /* basic block for a host call of a subroutine */
+	BB_TYPE_EXTERNAL = 'E'  /* basic block for addresses outside the unit; links or returns */
 };
 
 bool is_start_of_basicblock(cpu_t *cpu, addr_t a);
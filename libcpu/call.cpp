@@ -0,0 +1,108 @@
+/*
+ * libcpu: call.cpp
+ *
+ * Subroutines as host functions (CPU_CODEGEN_CALLS). A guest call
+ * to a known subroutine becomes a host call of the unit that can
+ * be entered there, through its link slot, with the register file
+ * as the calling convention: registers are spilled before the
+ * call and reloaded after it. A guest return leaves the unit with
+ * JIT_RETURN_GUESTRET, and the caller continues after the call if
+ * the guest returned there. The host's call/return pairs then
+ * match the guest's, which helps its return address prediction,
+ * and recursion needs no dispatch at all.
+ */
+
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "function.h"
+#include "link.h"
+#include "smc.h"
+#include "call.h"
+
+bool
+call_enabled(cpu_t *cpu)
+{
+	if (!(cpu->flags_codegen & CPU_CODEGEN_CALLS))
+		return false;
+	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))
+		return false;
+	/* its decoded state can't be reloaded after a call */
+	return cpu->f.emit_decode_reg == NULL;
+}
+
+/*
+ * Create the basic block a call at 'pc' to 'target' branches to,
+ * once the call instruction has stored its return address.
+ * If the callee isn't translated yet, or the host stack is deep
+ * enough already, it continues in 'bb_link' like any branch.
+ */
+BasicBlock *
+create_call_basicblock(cpu_t *cpu, addr_t pc, addr_t target, addr_t ret_pc,
+	BasicBlock *bb_link, BasicBlock *bb_dispatch, BasicBlock *bb_ret)
+{
+	PointerType *type_pfunc = cpu->cur_func->getType();
+	BasicBlock *bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_CALL);
+	BasicBlock *bb_call = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_CALL);
+	BasicBlock *bb_back = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_CALL);
+	BasicBlock *bb_up = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_CALL);
+	BasicBlock *bb_cont = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_CALL);
+
+	Value *ptr_slot = get_host_pointer(cpu, link_get_slot(cpu, target), type_pfunc);
+	Value *ptr_depth = get_host_pointer(cpu, &cpu->call_depth, getIntegerType(32));
+
+	// bb: call if the callee is there and the stack isn't too deep
+	Value *fp = new LoadInst(ptr_slot, "", false, bb);
+	Value *depth = new LoadInst(ptr_depth, "", false, bb);
+	Value *callable = BinaryOperator::Create(Instruction::And,
+		new ICmpInst(*bb, ICmpInst::ICMP_NE, fp, ConstantPointerNull::get(type_pfunc), ""),
+		new ICmpInst(*bb, ICmpInst::ICMP_ULT, depth, ConstantInt::get(getIntegerType(32), LIMIT_CALL_DEPTH), ""),
+		"", bb);
+	BranchInst::Create(bb_call, bb_link, callable, bb);
+
+	// bb_call: enter the callee at 'target' with our registers
+	new StoreInst(BinaryOperator::Create(Instruction::Add, depth,
+		ConstantInt::get(getIntegerType(32), 1), "", bb_call), ptr_depth, false, bb_call);
+	emit_store_pc(cpu, bb_call, target);
+	spill_reg_state(cpu, bb_call);
+	std::vector<Value*> args;
+	args.push_back(cpu->ptr_RAM);
+	args.push_back(cpu->ptr_grf);
+	args.push_back(cpu->ptr_frf);
+	args.push_back(cpu->ptr_func_debug);
+	Value *ret = CallInst::Create(fp, args, "", bb_call);
+	new StoreInst(depth, ptr_depth, false, bb_call);
+	Value *returned = new ICmpInst(*bb_call, ICmpInst::ICMP_EQ, ret,
+		ConstantInt::get(getIntegerType(32), JIT_RETURN_GUESTRET), "");
+	BranchInst::Create(bb_back, bb_up, returned, bb_call);
+
+	// bb_up: anything else goes up to cpu_run(); the register file
+	// holds the guest state already
+	ReturnInst::Create(_CTX(), ret, bb_up);
+
+	// bb_back: continue after the call, unless the guest returned
+	// somewhere else or wrote to translated code
+	reload_reg_state(cpu, bb_back);
+	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb_back);
+	Value *expected = new ICmpInst(*bb_back, ICmpInst::ICMP_EQ, v_pc,
+		ConstantInt::get(getIntegerType(cpu->info.address_size), ret_pc), "");
+	BranchInst::Create(bb_cont, bb_dispatch, expected, bb_back);
+
+	BasicBlock *bb_after = const_cast<BasicBlock*>(lookup_basicblock(cpu,
+		cpu->cur_func, ret_pc, bb_ret, BB_TYPE_NORMAL));
+	if (smc_enabled(cpu))
+		emit_smc_guard(cpu, bb_cont, bb_ret, bb_after);
+	else
+		BranchInst::Create(bb_after, bb_cont);
+
+	return bb;
+}
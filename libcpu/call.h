@@ -0,0 +1,2 @@
+bool call_enabled(cpu_t *cpu);
+BasicBlock *create_call_basicblock(cpu_t *cpu, addr_t pc, addr_t target, addr_t ret_pc, BasicBlock *bb_link, BasicBlock *bb_dispatch, BasicBlock *bb_ret);
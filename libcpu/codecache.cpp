@@ -0,0 +1,386 @@
+/*
+ * libcpu: codecache.cpp
+ *
+ * Book keeping of translation units. Every unit gets an id that
+ * stays valid for as long as the unit lives and is handed out
+ * again once it's freed, so the cache grows with the guest code
+ * instead of being limited to a fixed number of functions.
+ *
+ * If the client sets a limit on the host code size, cold units
+ * are evicted in clock order: every unit sets its 'referenced'
+ * flag when it is entered, and the clock hand evicts the first
+ * unit it finds without the flag, clearing it on the way.
+ */
+#include <assert.h>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "tag.h"
+#include "entry.h"
+#include "link.h"
+#include "shadow.h"
+#include "ibtc.h"
+#include "smc.h"
+#include "async.h"
+#include "codecache.h"
+
+/* the JIT tells us how much code it has emitted for a unit */
+class CodeSizeListener : public JITEventListener {
+	cpu_t *cpu;
+public:
+	CodeSizeListener(cpu_t *cpu) : cpu(cpu) {}
+
+	virtual void NotifyFunctionEmitted(const Function &F, void *Code,
+		size_t Size, const EmittedFunctionDetails &Details)
+	{
+		cpu_unit_t *unit = cpu->cur_unit;
+		if (unit != NULL && unit->func == &F) {
+			unit->code_size = Size;
+			cpu->code_size += Size;
+		}
+	}
+};
+
+void
+codecache_init(cpu_t *cpu)
+{
+	cpu->unit_count = 0;
+	cpu->code_size = 0;
+	cpu->code_cache_limit = 0;
+	cpu->clock_hand = 0;
+	cpu->hot_threshold = 0;
+	cpu->hot_unit = NULL;
+	cpu->tier_ups = 0;
+	cpu->traces = 0;
+	cpu->loop_traces = 0;
+	cpu->cur_unit = NULL;
+	cpu->cur_func = NULL;
+	cpu->jit_listener = new CodeSizeListener(cpu);
+	cpu->exec_engine->RegisterJITEventListener(cpu->jit_listener);
+}
+
+/* free all units; must be called before the execution engine goes */
+void
+codecache_done(cpu_t *cpu)
+{
+	if (cpu->jit_listener == NULL)
+		return;
+
+	codecache_flush(cpu);
+	cpu->exec_engine->UnregisterJITEventListener(cpu->jit_listener);
+	delete cpu->jit_listener;
+	cpu->jit_listener = NULL;
+}
+
+/* allocate a unit for 'func', which is about to be translated */
+cpu_unit_t *
+codecache_new_unit(cpu_t *cpu, Function *func)
+{
+	cpu_unit_t *unit = new cpu_unit_t;
+	assert(unit != NULL);
+
+	if (cpu->free_units.empty()) {
+		unit->id = cpu->units.size();
+		cpu->units.push_back(unit);
+	} else {
+		unit->id = cpu->free_units.back();
+		cpu->free_units.pop_back();
+		cpu->units[unit->id] = unit;
+	}
+	unit->func = func;
+	unit->fp = NULL;
+	unit->code_size = 0;
+	unit->referenced = 1; // give it a chance to run first
+	unit->tier = 1;
+	unit->count = 0;
+	unit->leave = 0;
+	unit->background = false;
+	unit->replaces = NULL;
+	unit->replacement = NULL;
+	cpu->unit_count++;
+
+	cpu->cur_unit = unit;
+	cpu->cur_func = func;
+	return unit;
+}
+
+/* the (already emitted) unit can be entered at 'pc' */
+void
+codecache_add_entry(cpu_t *cpu, cpu_unit_t *unit, addr_t pc)
+{
+	entry_insert(cpu, pc, unit);
+	link_update(cpu, pc, unit->fp);
+	unit->entries.push_back(pc);
+}
+
+/* the guest code [start, end) gets translated into the current unit */
+void
+codecache_add_range(cpu_t *cpu, addr_t start, addr_t end)
+{
+	addr_range_t range = { start, end };
+	cpu->cur_unit->ranges.push_back(range);
+	smc_add_range(cpu, start, end);
+}
+
+/* make the current unit set its 'referenced' flag in 'bb' */
+void
+codecache_emit_reference(cpu_t *cpu, BasicBlock *bb)
+{
+	Value *ptr_ref = get_host_pointer(cpu, &cpu->cur_unit->referenced, getIntegerType(8));
+
+	new StoreInst(ConstantInt::get(getIntegerType(8), 1), ptr_ref, false, bb);
+}
+
+/* tell cpu_run() that the current unit is hot, and return there */
+void
+codecache_emit_hot_exit(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_ret)
+{
+	Constant *v_unit = get_host_address(cpu, cpu->cur_unit);
+	Value *ptr_hot = get_host_pointer(cpu, &cpu->hot_unit, v_unit->getType());
+
+	new StoreInst(v_unit, ptr_hot, false, bb);
+	BranchInst::Create(bb_ret, bb);
+}
+
+/*
+ * Count the entries into the current unit in 'bb'. The entry
+ * that reaches the hot threshold returns to cpu_run() before
+ * any guest code has run, so cpu_run() can optimize the unit
+ * and enter the new code at the same PC. Loops that don't leave
+ * the unit are counted at their heads, see profile.cpp.
+ * Returns the block to continue in.
+ */
+BasicBlock *
+codecache_emit_counter(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_ret)
+{
+	cpu_unit_t *unit = cpu->cur_unit;
+	Value *ptr_count = get_host_pointer(cpu, &unit->count, getIntegerType(32));
+
+	BasicBlock *bb_hot = BasicBlock::Create(_CTX(), "hot", cpu->cur_func, 0);
+	BasicBlock *bb_cont = BasicBlock::Create(_CTX(), "counted", cpu->cur_func, 0);
+
+	Value *count = BinaryOperator::Create(Instruction::Add,
+		new LoadInst(ptr_count, "", false, bb),
+		ConstantInt::get(getIntegerType(32), 1), "", bb);
+	new StoreInst(count, ptr_count, false, bb);
+	Value *is_hot = new ICmpInst(*bb, ICmpInst::ICMP_EQ, count,
+		ConstantInt::get(getIntegerType(32), cpu->hot_threshold), "");
+	BranchInst::Create(bb_hot, bb_cont, is_hot, bb);
+
+	codecache_emit_hot_exit(cpu, bb_hot, bb_ret);
+
+	return bb_cont;
+}
+
+/*
+ * Free a unit and make sure nothing can get into it anymore:
+ * cpu_run() won't find its entries, and linked code returns
+ * to cpu_run() instead of tail calling it. Unless it has been
+ * replaced, its code is untagged, so it gets tagged and
+ * translated again once it is reached.
+ */
+static void
+codecache_release_unit(cpu_t *cpu, cpu_unit_t *unit, bool untag)
+{
+	for (addr_list::const_iterator it = unit->entries.begin(); it != unit->entries.end(); it++) {
+		/* a newer unit may have taken over the entry */
+		if (entry_lookup_unit(cpu, *it) != unit)
+			continue;
+		entry_remove(cpu, *it);
+		link_update(cpu, *it, NULL);
+	}
+	/* the shadow stack and the branch caches may point into it */
+	shadow_clear(cpu);
+	ibtc_clear_caches(cpu);
+	/* it may still be waiting for the compile thread */
+	async_forget_unit(cpu, unit);
+	if (unit->replaces != NULL)
+		unit->replaces->replacement = NULL;
+	/* a replacement of the same code is just as stale */
+	if (unit->replacement != NULL) {
+		unit->replacement->replaces = NULL;
+		codecache_release_unit(cpu, unit->replacement, untag);
+	}
+	if (cpu->hot_unit == unit)
+		cpu->hot_unit = NULL;
+
+	for (range_list::const_iterator it = unit->ranges.begin(); it != unit->ranges.end(); it++) {
+		if (untag)
+			for (addr_t pc = it->start; pc < it->end; pc++)
+				clear_tag(cpu, pc, TAG_CODE | TAG_TRANSLATED);
+		smc_remove_range(cpu, it->start, it->end);
+	}
+
+	if (unit->background) {
+		async_free_code(cpu, unit->func);
+	} else {
+		if (unit->fp != NULL)
+			cpu->exec_engine->freeMachineCodeForFunction(unit->func);
+		cpu->func_bb.erase(unit->func);
+		unit->func->eraseFromParent();
+	}
+
+	if (cpu->cur_unit == unit) {
+		cpu->cur_unit = NULL;
+		cpu->cur_func = NULL;
+	}
+	cpu->units[unit->id] = NULL;
+	cpu->free_units.push_back(unit->id);
+	cpu->unit_count--;
+	cpu->code_size -= unit->code_size;
+	delete unit;
+}
+
+void
+codecache_free_unit(cpu_t *cpu, cpu_unit_t *unit)
+{
+	codecache_release_unit(cpu, unit, true);
+}
+
+/* free a unit whose entries have all been taken over by a new one */
+void
+codecache_retire_unit(cpu_t *cpu, cpu_unit_t *unit)
+{
+	codecache_release_unit(cpu, unit, false);
+}
+
+void
+codecache_flush(cpu_t *cpu)
+{
+	/* before the units the jobs point to go */
+	async_forget_all(cpu);
+
+	for (unit_list::const_iterator it = cpu->units.begin(); it != cpu->units.end(); it++) {
+		cpu_unit_t *unit = *it;
+		if (unit == NULL)
+			continue;
+		if (unit->background) {
+			async_free_code(cpu, unit->func);
+		} else {
+			if (unit->fp != NULL)
+				cpu->exec_engine->freeMachineCodeForFunction(unit->func);
+			unit->func->eraseFromParent();
+		}
+		delete unit;
+	}
+	cpu->units.clear();
+	cpu->free_units.clear();
+	cpu->clock_hand = 0;
+	cpu->hot_unit = NULL;
+	cpu->unit_count = 0;
+	cpu->code_size = 0;
+	cpu->cur_unit = NULL;
+	cpu->cur_func = NULL;
+
+	entry_clear(cpu);
+	link_clear(cpu);
+	shadow_clear(cpu);
+	ibtc_clear_caches(cpu);
+	smc_clear(cpu);
+	cpu->func_bb.clear();
+}
+
+static bool
+unit_overlaps(cpu_unit_t *unit, addr_t start, addr_t end)
+{
+	for (range_list::const_iterator it = unit->ranges.begin(); it != unit->ranges.end(); it++)
+		if (it->start < end && start < it->end)
+			return true;
+	return false;
+}
+
+/*
+ * The guest code in [start, end) has changed: free the units that
+ * were translated from it, and untag it, so it is tagged and
+ * translated again from the new bytes when it is reached.
+ * Must not be called while translated code runs.
+ */
+void
+cpu_invalidate_range(cpu_t *cpu, addr_t start, addr_t end)
+{
+	/* units that are still being compiled are freed as well */
+	for (unit_list::const_iterator it = cpu->units.begin(); it != cpu->units.end(); it++) {
+		cpu_unit_t *unit = *it;
+		if (unit != NULL && unit_overlaps(unit, start, end)) {
+			LOG("invalidating unit %u\n", unit->id);
+			codecache_free_unit(cpu, unit);
+		}
+	}
+
+	clear_code_range(cpu, start, end);
+}
+
+/*
+ * Evict cold units until the code fits into the limit again.
+ * Two sweeps are enough: the first one clears all flags.
+ */
+void
+codecache_trim(cpu_t *cpu)
+{
+	size_t steps = 2 * cpu->units.size();
+
+	if (cpu->code_cache_limit == 0)
+		return;
+
+	while (cpu->code_size > cpu->code_cache_limit && steps-- > 0) {
+		if (cpu->clock_hand >= cpu->units.size())
+			cpu->clock_hand = 0;
+		cpu_unit_t *unit = cpu->units[cpu->clock_hand++];
+		/* pending units have no code yet */
+		if (unit == NULL || unit->fp == NULL)
+			continue;
+		if (unit->referenced) {
+			unit->referenced = 0;
+			continue;
+		}
+		LOG("evicting unit %u\n", unit->id);
+		codecache_free_unit(cpu, unit);
+	}
+}
+
+/*
+ * Limit the host code kept in the cache to 'limit' bytes (0: no
+ * limit). This is a soft limit: the cache is only trimmed before
+ * new code gets translated, never while translated code runs,
+ * so it may exceed the limit by the most recently translated code.
+ */
+void
+cpu_set_code_cache_limit(cpu_t *cpu, size_t limit)
+{
+	cpu->code_cache_limit = limit;
+}
+
+/*
+ * Translate new code without optimization, and count how often
+ * it is entered; code entered 'entries' times, or with a loop
+ * that has run that often, is translated again with the
+ * expensive optimizations and its block counts
+ * (0: optimize everything right away, at the optimization level).
+ * Code that only runs a few times, like startup code, doesn't
+ * pay for the optimizer this way.
+ */
+void
+cpu_set_hot_threshold(cpu_t *cpu, uint32_t entries)
+{
+	cpu->hot_threshold = entries;
+}
+
+void
+cpu_get_code_cache_stats(cpu_t *cpu, cpu_code_cache_stats_t *stats)
+{
+	stats->units = cpu->unit_count;
+	stats->capacity = cpu->units.size();
+	stats->entries = entry_count(cpu);
+	stats->code_size = cpu->code_size;
+	stats->tier_ups = cpu->tier_ups;
+	stats->traces = cpu->traces;
+	stats->loop_traces = cpu->loop_traces;
+}
@@ -0,0 +1,12 @@
+void codecache_init(cpu_t *cpu);
+void codecache_done(cpu_t *cpu);
+cpu_unit_t *codecache_new_unit(cpu_t *cpu, Function *func);
+void codecache_add_entry(cpu_t *cpu, cpu_unit_t *unit, addr_t pc);
+void codecache_add_range(cpu_t *cpu, addr_t start, addr_t end);
+void codecache_emit_reference(cpu_t *cpu, BasicBlock *bb);
+void codecache_emit_hot_exit(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_ret);
+BasicBlock *codecache_emit_counter(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_ret);
+void codecache_trim(cpu_t *cpu);
+void codecache_free_unit(cpu_t *cpu, cpu_unit_t *unit);
+void codecache_retire_unit(cpu_t *cpu, cpu_unit_t *unit);
+void codecache_flush(cpu_t *cpu);
@@ -8,5 +8,6 @@
 #cmakedefine HAVE_DECLSPEC_DLLEXPORT ${HAVE_DECLSPEC_DLLEXPORT}
 #cmakedefine HAVE_LIBREADLINE ${HAVE_LIBREADLINE}
 #cmakedefine HAVE_NETINET_IN_H ${HAVE_NETINET_IN_H}
+#cmakedefine HAVE_PTHREAD_H ${HAVE_PTHREAD_H}
 
 #cmakedefine HAVE_LIBRT ${HAVE_LIBRT}
@@ -15,3 +15,42 @@
 // DFS limit when CPU_CODEGEN_TAG_LIMIT is set by the client.
 // '6' is the optimum for OpenBSD's 'date' on M88K.
 #define LIMIT_TAGGING_DFS 6
+
+// Maximum number of basic blocks in one translation unit. Bigger
+// units optimize better, but LLVM compile time grows faster than
+// linear with the function size.
+#define LIMIT_REGION_BBS 256
+
+// Number of recent targets every computed branch compares against
+// before it falls back to the dispatch switch.
+#define IBTC_WAYS 2
+
+// Depth of the shadow return stack; must be a power of two. Deeper
+// call chains wrap around and lose the oldest predictions.
+#define SHADOW_STACK_SIZE 64
+
+// Host call depth of translated code with CPU_CODEGEN_CALLS;
+// deeper guest calls are linked like branches instead.
+#define LIMIT_CALL_DEPTH 1024
+
+// Units that link to each other without returning to cpu_run().
+// Linking is a tail call, but LLVM doesn't guarantee to make it a
+// jump, so each link may cost a host stack frame.
+#define LIMIT_LINK_DEPTH 256
+
+// Granularity of self modifying code detection. Writes to data that
+// shares a page with translated code leave the unit, so smaller is
+// better for guests that mix code and data.
+#define SMC_PAGE_SHIFT 10
+
+// Superblocks formed along the hot paths of a unit when it is
+// recompiled, and the basic blocks each of them may copy.
+#define LIMIT_TRACES 4
+#define LIMIT_TRACE_BBS 16
+
+// Tags are allocated in pages of this many instruction locations.
+#define TAG_PAGE_SHIFT 10
+
+// No instruction of any frontend is longer (x86: 15, m68k: 22), so
+// a write to code only changes instructions that start this close.
+#define TAG_MAX_INSTR_BYTES 32
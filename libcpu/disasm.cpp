@@ -23,7 +23,7 @@ void disasm_instr(cpu_t *cpu, addr_t pc) {
 	/* delay slot */
 	tag_t tag;
 	addr_t dummy, dummy2;
-	cpu->f.tag_instr(cpu, pc, &tag, &dummy, &dummy2);
+	tag_instr(cpu, pc, &tag, &dummy, &dummy2);
 	if (tag & TAG_DELAY_SLOT)
 		bytes = cpu->f.disasm_instr(cpu, pc + bytes, disassembly_line2, sizeof(disassembly_line2));
 
@@ -0,0 +1,178 @@
+/*
+ * libcpu: entry.cpp
+ *
+ * Map guest addresses to the host code that can be entered
+ * there, so cpu_run() can find the right translation with a
+ * single lookup instead of trying every translated function.
+ */
+#include <assert.h>
+
+#include "libcpu.h"
+#include "entry.h"
+
+/*
+ * Open addressing with linear probing. NEW_PC_NONE (all ones)
+ * marks an empty slot; it is never inside the code area, so it
+ * can't collide with a real entry.
+ */
+#define ENTRY_EMPTY        ((addr_t)-1)
+#define ENTRY_INITIAL_SIZE 256
+
+struct entry_table {
+	addr_t *pc;
+	cpu_unit_t **unit;
+	uint32_t size;  /* always a power of two */
+	uint32_t count;
+};
+
+static inline uint32_t
+entry_hash(entry_table_t *t, addr_t pc)
+{
+	/* Fibonacci hashing; guest code addresses are often aligned */
+	return (uint32_t)((pc * 0x9E3779B97F4A7C15ULL) >> 32) & (t->size - 1);
+}
+
+static void
+entry_alloc(entry_table_t *t, uint32_t size)
+{
+	t->pc = (addr_t *)malloc(size * sizeof(addr_t));
+	t->unit = (cpu_unit_t **)calloc(size, sizeof(cpu_unit_t *));
+	assert(t->pc != NULL && t->unit != NULL);
+	for (uint32_t i = 0; i < size; i++)
+		t->pc[i] = ENTRY_EMPTY;
+	t->size = size;
+	t->count = 0;
+}
+
+static void
+entry_put(entry_table_t *t, addr_t pc, cpu_unit_t *unit)
+{
+	uint32_t i = entry_hash(t, pc);
+
+	while (t->pc[i] != ENTRY_EMPTY && t->pc[i] != pc)
+		i = (i + 1) & (t->size - 1);
+
+	if (t->pc[i] == ENTRY_EMPTY) {
+		t->pc[i] = pc;
+		t->count++;
+	}
+	t->unit[i] = unit;
+}
+
+static void
+entry_grow(entry_table_t *t)
+{
+	addr_t *old_pc = t->pc;
+	cpu_unit_t **old_unit = t->unit;
+	uint32_t old_size = t->size;
+
+	entry_alloc(t, old_size * 2);
+	for (uint32_t i = 0; i < old_size; i++)
+		if (old_pc[i] != ENTRY_EMPTY)
+			entry_put(t, old_pc[i], old_unit[i]);
+
+	free(old_pc);
+	free(old_unit);
+}
+
+void
+entry_init(cpu_t *cpu)
+{
+	cpu->entry_table = (entry_table_t *)malloc(sizeof(entry_table_t));
+	assert(cpu->entry_table != NULL);
+	entry_alloc(cpu->entry_table, ENTRY_INITIAL_SIZE);
+}
+
+void
+entry_done(cpu_t *cpu)
+{
+	if (cpu->entry_table == NULL)
+		return;
+
+	free(cpu->entry_table->pc);
+	free(cpu->entry_table->unit);
+	free(cpu->entry_table);
+	cpu->entry_table = NULL;
+}
+
+void
+entry_insert(cpu_t *cpu, addr_t pc, cpu_unit_t *unit)
+{
+	entry_table_t *t = cpu->entry_table;
+
+	/* keep the load factor below 1/2, so probe sequences stay short */
+	if ((t->count + 1) * 2 > t->size)
+		entry_grow(t);
+
+	entry_put(t, pc, unit);
+}
+
+static uint32_t
+entry_find(entry_table_t *t, addr_t pc)
+{
+	uint32_t i = entry_hash(t, pc);
+
+	while (t->pc[i] != ENTRY_EMPTY && t->pc[i] != pc)
+		i = (i + 1) & (t->size - 1);
+	return i;
+}
+
+cpu_unit_t *
+entry_lookup_unit(cpu_t *cpu, addr_t pc)
+{
+	entry_table_t *t = cpu->entry_table;
+	return t->unit[entry_find(t, pc)];
+}
+
+/* also called from translated code, see create_lookup_basicblock() */
+void *
+entry_lookup(cpu_t *cpu, addr_t pc)
+{
+	cpu_unit_t *unit = entry_lookup_unit(cpu, pc);
+	return unit != NULL ? unit->fp : NULL;
+}
+
+void
+entry_remove(cpu_t *cpu, addr_t pc)
+{
+	entry_table_t *t = cpu->entry_table;
+	uint32_t i = entry_find(t, pc);
+	uint32_t j = i;
+
+	if (t->pc[i] == ENTRY_EMPTY)
+		return;
+
+	/* move back later entries of the probe sequence into the gap */
+	for (;;) {
+		j = (j + 1) & (t->size - 1);
+		if (t->pc[j] == ENTRY_EMPTY)
+			break;
+		uint32_t k = entry_hash(t, t->pc[j]);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		t->pc[i] = t->pc[j];
+		t->unit[i] = t->unit[j];
+		i = j;
+	}
+	t->pc[i] = ENTRY_EMPTY;
+	t->unit[i] = NULL;
+	t->count--;
+}
+
+uint32_t
+entry_count(cpu_t *cpu)
+{
+	return cpu->entry_table->count;
+}
+
+void
+entry_clear(cpu_t *cpu)
+{
+	entry_table_t *t = cpu->entry_table;
+
+	for (uint32_t i = 0; i < t->size; i++) {
+		t->pc[i] = ENTRY_EMPTY;
+		t->unit[i] = NULL;
+	}
+	t->count = 0;
+}
@@ -0,0 +1,8 @@
+void entry_init(cpu_t *cpu);
+void entry_done(cpu_t *cpu);
+void entry_insert(cpu_t *cpu, addr_t pc, cpu_unit_t *unit);
+cpu_unit_t *entry_lookup_unit(cpu_t *cpu, addr_t pc);
+void *entry_lookup(cpu_t *cpu, addr_t pc);
+void entry_remove(cpu_t *cpu, addr_t pc);
+uint32_t entry_count(cpu_t *cpu);
+void entry_clear(cpu_t *cpu);
@@ -0,0 +1,151 @@
+/*
+ * libcpu: flags.cpp
+ *
+ * Dead flags. Before a region is translated, a backward data flow
+ * analysis over its tagged instructions finds the flags that are
+ * live after each of them, i.e. may be read before they are written
+ * again. The frontend tells which flags an instruction reads and
+ * writes (f.flags_instr), and asks flag_is_live() before it emits
+ * the code for one. All flags are live wherever execution leaves
+ * the region or goes somewhere unknown: calls, returns, traps and
+ * computed branches.
+ */
+#include <map>
+#include <vector>
+
+#include "libcpu.h"
+#include "tag.h"
+#include "basicblock.h"
+#include "flags.h"
+
+#define FLAGS_ALL ((uint32_t)-1)
+
+static bool
+flags_enabled(cpu_t *cpu)
+{
+	if (cpu->f.flags_instr == NULL)
+		return false;
+	return !(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB));
+}
+
+/* the flags live after every instruction of 'region' */
+void
+flags_analyze(cpu_t *cpu, const addr_list &region)
+{
+	std::map<addr_t, size_t> index;
+	addr_list instrs;
+	std::vector<uint32_t> read, written, live_in, live_out;
+	std::vector<std::vector<size_t> > succ;
+	std::vector<bool> leaves;
+	bool changed;
+	size_t i;
+
+	cpu->flags_live_out.clear();
+	if (!flags_enabled(cpu))
+		return;
+
+	for (addr_list::const_iterator it = region.begin(); it != region.end(); it++) {
+		addr_t pc = *it;
+		for (;;) {
+			tag_t tag, dummy;
+			addr_t new_pc, next_pc;
+
+			index[pc] = instrs.size();
+			instrs.push_back(pc);
+
+			tag = get_tag(cpu, pc);
+			tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+			if (!(tag & TAG_CONTINUE))
+				break;
+			pc = next_pc;
+			if (!is_code(cpu, pc) || is_start_of_basicblock(cpu, pc))
+				break;
+		}
+	}
+
+	read.resize(instrs.size());
+	written.resize(instrs.size());
+	succ.resize(instrs.size());
+	leaves.resize(instrs.size());
+	for (i = 0; i < instrs.size(); i++) {
+		tag_t tag, dummy;
+		addr_t new_pc, next_pc;
+		addr_list targets;
+
+		tag = get_tag(cpu, instrs[i]);
+		tag_instr(cpu, instrs[i], &dummy, &new_pc, &next_pc);
+		cpu->f.flags_instr(cpu, instrs[i], &read[i], &written[i]);
+
+		/* a conditional instruction may not write anything */
+		if ((tag & TAG_CONDITIONAL) && !(tag & (TAG_BRANCH | TAG_CALL | TAG_RET | TAG_TRAP)))
+			written[i] = 0;
+
+		leaves[i] = !!(tag & (TAG_CALL | TAG_RET | TAG_TRAP | TAG_DELAY_SLOT));
+		if (tag & TAG_BRANCH) {
+			if (new_pc == NEW_PC_NONE)
+				leaves[i] = true;
+			else
+				targets.push_back(new_pc);
+		}
+		if (tag & (TAG_CONTINUE | TAG_CONDITIONAL))
+			targets.push_back(next_pc);
+
+		for (addr_list::const_iterator t = targets.begin(); t != targets.end(); t++) {
+			std::map<addr_t, size_t>::const_iterator s = index.find(*t);
+			if (s == index.end())
+				leaves[i] = true;
+			else
+				succ[i].push_back(s->second);
+		}
+	}
+
+	/* iterate to the smallest fixed point */
+	live_in.assign(instrs.size(), 0);
+	live_out.assign(instrs.size(), 0);
+	do {
+		changed = false;
+		for (i = instrs.size(); i-- > 0;) {
+			uint32_t out = leaves[i] ? FLAGS_ALL : 0;
+			for (std::vector<size_t>::const_iterator s = succ[i].begin(); s != succ[i].end(); s++)
+				out |= live_in[*s];
+			uint32_t in = read[i] | (out & ~written[i]);
+			live_out[i] = out;
+			if (in != live_in[i]) {
+				live_in[i] = in;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (i = 0; i < instrs.size(); i++)
+		cpu->flags_live_out[instrs[i]] = live_out[i];
+}
+
+void
+flags_forget(cpu_t *cpu)
+{
+	cpu->flags_live_out.clear();
+}
+
+/*
+ * Whether the flag of the given type (e.g. CPU_FLAGTYPE_CARRY) may
+ * be read after the instruction at 'pc'. Without an analysis of
+ * the code, everything is live.
+ */
+bool
+flag_is_live(cpu_t *cpu, addr_t pc, char type)
+{
+	flagmask_map::const_iterator it;
+	cpu_flags_layout_t const *flags_layout = cpu->info.flags_layout;
+
+	if (!flags_enabled(cpu))
+		return true;
+	it = cpu->flags_live_out.find(pc);
+	if (it == cpu->flags_live_out.end())
+		return true;
+
+	for (size_t i = 0; i < cpu->info.flags_count; i++)
+		if (flags_layout[i].type == type)
+			return !!(it->second & (1U << flags_layout[i].shift));
+	return true;
+}
@@ -0,0 +1,2 @@
+void flags_analyze(cpu_t *cpu, const addr_list &region);
+void flags_forget(cpu_t *cpu);
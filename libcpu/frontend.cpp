@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Intrinsics.h"
@@ -18,6 +19,7 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "frontend.h"
+#include "smc.h"
 
 //////////////////////////////////////////////////////////////////////
 // GENERIC: register access
@@ -176,6 +178,25 @@ RAM32LE(uint8_t *RAM, addr_t a) {
 	return v;
 }
 
+//////////////////////////////////////////////////////////////////////
+// GENERIC: host data
+//////////////////////////////////////////////////////////////////////
+
+/* the address of host data, as an integer of pointer size */
+Constant *
+get_host_address(cpu_t *cpu, void *p)
+{
+	IntegerType *intptr_type = cpu->exec_engine->getDataLayout()->getIntPtrType(_CTX());
+	return ConstantInt::get(intptr_type, (uintptr_t)p);
+}
+
+/* a pointer to host data of type 'type' */
+Constant *
+get_host_pointer(cpu_t *cpu, void *p, Type *type)
+{
+	return ConstantExpr::getIntToPtr(get_host_address(cpu, p), PointerType::getUnqual(type));
+}
+
 //////////////////////////////////////////////////////////////////////
 // GENERIC: memory access
 //////////////////////////////////////////////////////////////////////
@@ -201,7 +222,7 @@ arch_load32_aligned(cpu_t *cpu, Value *a, BasicBlock *bb) {
 void
 arch_store32_aligned(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb) {
 	a = arch_gep32(cpu, a, bb);
-	new StoreInst((cpu->flags & CPU_FLAG_SWAPMEM) ? SWAP32(v) : v, a, bb);
+	arch_store(cpu, (cpu->flags & CPU_FLAG_SWAPMEM) ? SWAP32(v) : v, a, bb);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -262,9 +283,29 @@ arch_store16(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb) {
 
 //
 
+/* the guest address if 'a' points into guest RAM, or NULL */
+static Value *
+arch_ram_address(cpu_t *cpu, Value *a)
+{
+	if (BitCastInst *cast = dyn_cast<BitCastInst>(a))
+		a = cast->getOperand(0);
+
+	GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(a);
+	if (gep == NULL || gep->getPointerOperand() != cpu->ptr_RAM ||
+			gep->getNumIndices() != 1)
+		return NULL;
+	return gep->getOperand(1);
+}
+
+/* every store to guest RAM goes through here, see smc.cpp */
 Value *
-arch_store(Value *v, Value *a, BasicBlock *bb)
+arch_store(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb)
 {
+	Value *ram_a = arch_ram_address(cpu, a);
+
+	if (ram_a != NULL)
+		emit_smc_store_check(cpu, ram_a,
+			cpu->exec_engine->getDataLayout()->getTypeStoreSize(v->getType()), bb);
 	new StoreInst(v, a, bb);
 	return v;
 }
@@ -305,50 +346,39 @@ arch_shiftrotate(cpu_t *cpu, Value *dst, Value *src, bool left, bool rotate, Bas
 		c = ICMP_SLT(v, CONSTs(SIZE(v), 0));	/* old MSB to carry */
 		v = SHL(v, CONSTs(SIZE(v), 1));
 		if (rotate)
-			v = OR(v,ZEXT(SIZE(v), LOAD(cpu->ptr_C)));
+			v = OR(v,ZEXT(SIZE(v), FLAG(cpu->ptr_C)));
 	} else {
 		c = TRUNC1(v);		/* old LSB to carry */
 		v = LSHR(v, CONSTs(SIZE(v), 1));
 		if (rotate)
-			v = OR(v,SHL(ZEXT(SIZE(v), LOAD(cpu->ptr_C)), CONSTs(SIZE(v), SIZE(v)-1)));
+			v = OR(v,SHL(ZEXT(SIZE(v), FLAG(cpu->ptr_C)), CONSTs(SIZE(v), SIZE(v)-1)));
 	}
 	
-	LET1(cpu->ptr_C, c);
+	LET_FLAG(cpu->ptr_C, c);
 	return STORE(v, dst);
 }
 
-// adds src + v + c and stores it in dst
+// adds src + v + c, stores it in dst and sets the flags of 'types'
+// ("C" or "CV") from it
 Value *
-arch_adc(cpu_t *cpu, Value *dst, Value *src, Value *v, bool plus_carry, bool plus_one, BasicBlock *bb)
+arch_adc(cpu_t *cpu, Value *dst, Value *src, Value *v, bool plus_carry, bool plus_one, const char *types, BasicBlock *bb)
 {
 	Value *c;
 	if (plus_carry)
-		c = LOAD(cpu->ptr_C);
+		c = FLAG(cpu->ptr_C);
 	else if (plus_one)
 		c = CONST1(1);
 	else
 		c = CONST1(0);
 
-	if (SIZE(v) == 8) {
-		/* calculate intermediate result */
-		Value *v1 = ADD(ADD(ZEXT16(LOAD(src)), ZEXT16(v)), ZEXT16(c));
-
-		/* get C */
-		STORE(TRUNC1(LSHR(v1, CONST16(8))), cpu->ptr_C);
+	Value *a = LOAD(src);
+	arch_set_flags_add(cpu, a, v, c, types, bb);
 
-		/* get result */
-		v1 = TRUNC8(v1);
+	Value *v1 = ADD(ADD(a, v), ZEXT(SIZE(v), c));
+	if (dst)
+		STORE(v1, dst);
 
-		if (dst)
-			STORE(v1, dst);
-
-		return v1;
-	} else {
-		//XXX TODO use llvm.uadd.with.overflow.*
-		//XXX consider using it for 8 bit also, if possible
-		printf("TODO: %s() can't do anything but 8 bits yet!\n", __func__);
-		exit(1);
-	}
+	return v1;
 }
 
 // branches
@@ -380,15 +410,20 @@ arch_jump(BasicBlock *bb, BasicBlock *bb_target) {
 
 // decoding and encoding of bits in a bitfield (e.g. flags)
 
-Value *
-arch_encode_bit(Value *flags, Value *bit, int shift, int width, BasicBlock *bb)
+static Value *
+encode_bit_value(Value *flags, Value *n, int shift, int width, BasicBlock *bb)
 {
-	Value *n = new LoadInst(bit, "", false, bb);
-	bit = new ZExtInst(n, getIntegerType(width), "", bb);
+	Value *bit = new ZExtInst(n, getIntegerType(width), "", bb);
 	bit = BinaryOperator::Create(Instruction::Shl, bit, ConstantInt::get(getIntegerType(width), shift), "", bb);
 	return BinaryOperator::Create(Instruction::Or, flags, bit, "", bb);
 }
 
+Value *
+arch_encode_bit(Value *flags, Value *bit, int shift, int width, BasicBlock *bb)
+{
+	return encode_bit_value(flags, new LoadInst(bit, "", false, bb), shift, width, bb);
+}
+
 void
 arch_decode_bit(Value *flags, Value *bit, int shift, int width, BasicBlock *bb)
 {
@@ -407,7 +442,8 @@ arch_flags_encode(cpu_t *cpu, BasicBlock *bb)
 	Value *flags = CONSTs(flags_size, 0);
 
 	for (size_t i = 0; i < cpu->info.flags_count; i++)
-		flags = arch_encode_bit(flags, cpu->ptr_FLAG[flags_layout[i].shift],
+		flags = encode_bit_value(flags,
+				arch_get_flag(cpu, cpu->ptr_FLAG[flags_layout[i].shift], bb),
 				flags_layout[i].shift, flags_size, bb);
 
 	return flags;
@@ -422,6 +458,266 @@ arch_flags_decode(cpu_t *cpu, Value *flags, BasicBlock *bb)
 	for (size_t i = 0; i < cpu->info.flags_count; i++)
 		arch_decode_bit(flags, cpu->ptr_FLAG[flags_layout[i].shift],
 				flags_layout[i].shift, flags_size, bb);
+
+	/* all flags are explicit now */
+	if (cpu->ptr_N_lazy != NULL)
+		LET1(cpu->ptr_N_lazy, FALSE);
+	if (cpu->ptr_Z_lazy != NULL)
+		LET1(cpu->ptr_Z_lazy, FALSE);
+	if (cpu->ptr_P_lazy != NULL)
+		LET1(cpu->ptr_P_lazy, FALSE);
+	if (cpu->ptr_C_lazy != NULL)
+		LET1(cpu->ptr_C_lazy, FALSE);
+	if (cpu->ptr_V_lazy != NULL)
+		LET1(cpu->ptr_V_lazy, FALSE);
+}
+
+// lazy flags
+//
+// N, Z and P only depend on the result of the operation that set
+// them, so arch_set_flags_result() keeps that result instead, and
+// the flags are computed where they are read: by a condition, or
+// by arch_flags_encode(). Every such flag has a "lazy" bit that
+// tells whether it is derived from the result or has been set
+// explicitly since. After mem2reg, these bits are constants almost
+// everywhere, and a flag that is overwritten before it is read
+// costs nothing.
+//
+// C and V also depend on the operands. arch_set_flags_add() keeps
+// the kind of the operation, both operands and the sum, and C and
+// V have lazy bits of their own. Subtractions are additions of the
+// complement with a carry, which is how the 6502 and ARM define C.
+
+#define LAZY_RESULT_WIDTH 64
+
+/* flags_op is the kind of operation: an addition of that many bits */
+#define LAZY_OP_ADD_MAX 32
+
+/* declare the lazy state of the flags of the generic layout */
+void
+arch_flags_lazy_init(cpu_t *cpu, BasicBlock *bb)
+{
+	cpu->ptr_N_lazy = NULL;
+	cpu->ptr_Z_lazy = NULL;
+	cpu->ptr_P_lazy = NULL;
+	cpu->ptr_flags_result = NULL;
+	cpu->ptr_C_lazy = NULL;
+	cpu->ptr_V_lazy = NULL;
+	cpu->ptr_flags_op = NULL;
+	cpu->ptr_flags_src1 = NULL;
+	cpu->ptr_flags_src2 = NULL;
+	cpu->ptr_flags_sum = NULL;
+
+	if (cpu->ptr_N != NULL || cpu->ptr_Z != NULL || cpu->ptr_P != NULL) {
+		if (cpu->ptr_N != NULL)
+			cpu->ptr_N_lazy = new AllocaInst(getIntegerType(1), "N_lazy", bb);
+		if (cpu->ptr_Z != NULL)
+			cpu->ptr_Z_lazy = new AllocaInst(getIntegerType(1), "Z_lazy", bb);
+		if (cpu->ptr_P != NULL)
+			cpu->ptr_P_lazy = new AllocaInst(getIntegerType(1), "P_lazy", bb);
+		cpu->ptr_flags_result = new AllocaInst(getIntegerType(LAZY_RESULT_WIDTH),
+			"flags_result", bb);
+	}
+
+	if (cpu->ptr_C != NULL || cpu->ptr_V != NULL) {
+		if (cpu->ptr_C != NULL)
+			cpu->ptr_C_lazy = new AllocaInst(getIntegerType(1), "C_lazy", bb);
+		if (cpu->ptr_V != NULL)
+			cpu->ptr_V_lazy = new AllocaInst(getIntegerType(1), "V_lazy", bb);
+		cpu->ptr_flags_op = new AllocaInst(getIntegerType(8), "flags_op", bb);
+		cpu->ptr_flags_src1 = new AllocaInst(getIntegerType(64), "flags_src1", bb);
+		cpu->ptr_flags_src2 = new AllocaInst(getIntegerType(64), "flags_src2", bb);
+		cpu->ptr_flags_sum = new AllocaInst(getIntegerType(64), "flags_sum", bb);
+	}
+}
+
+/* the lazy bit of a flag, if it can be lazy */
+static Value *
+lazy_flag_bit(cpu_t *cpu, Value *ptr_flag, char *type)
+{
+	if (ptr_flag == NULL)
+		return NULL;
+
+	if (ptr_flag == cpu->ptr_N) {
+		*type = CPU_FLAGTYPE_NEGATIVE;
+		return cpu->ptr_N_lazy;
+	}
+	if (ptr_flag == cpu->ptr_Z) {
+		*type = CPU_FLAGTYPE_ZERO;
+		return cpu->ptr_Z_lazy;
+	}
+	if (ptr_flag == cpu->ptr_P) {
+		*type = CPU_FLAGTYPE_PARITY;
+		return cpu->ptr_P_lazy;
+	}
+	if (ptr_flag == cpu->ptr_C) {
+		*type = CPU_FLAGTYPE_CARRY;
+		return cpu->ptr_C_lazy;
+	}
+	if (ptr_flag == cpu->ptr_V) {
+		*type = CPU_FLAGTYPE_OVERFLOW;
+		return cpu->ptr_V_lazy;
+	}
+	return NULL;
+}
+
+static Value *
+flag_from_result(cpu_t *cpu, char type, Value *res, BasicBlock *bb)
+{
+	switch (type) {
+		case CPU_FLAGTYPE_NEGATIVE:
+			return ICMP_SLT(res, CONSTs(SIZE(res), 0));
+		case CPU_FLAGTYPE_ZERO:
+			return ICMP_EQ(res, CONSTs(SIZE(res), 0));
+		default: {
+			/* even parity of the low byte */
+			Value *v = SIZE(res) > 8 ? TRUNC8(res) : res;
+			if (SIZE(v) < 8)
+				v = ZEXT8(v);
+			v = XOR(v, LSHR(v, CONST8(4)));
+			v = XOR(v, LSHR(v, CONST8(2)));
+			v = XOR(v, LSHR(v, CONST8(1)));
+			return NOT(TRUNC1(v));
+		}
+	}
+}
+
+/*
+ * C or V of an addition of 'width' bits; the operands are zero
+ * extended to 64 bits, and so is their sum, which doesn't wrap
+ */
+static Value *
+flag_from_add(cpu_t *cpu, char type, Value *width, Value *a, Value *b, Value *sum, BasicBlock *bb)
+{
+	if (type == CPU_FLAGTYPE_CARRY)
+		return TRUNC1(LSHR(sum, width));
+	/* the operands have the same sign, the sum has the other one */
+	return TRUNC1(LSHR(AND(XOR(a, sum), XOR(b, sum)), SUB(width, CONST64(1))));
+}
+
+static Value *
+lazy_flag_value(cpu_t *cpu, char type, BasicBlock *bb)
+{
+	if (type == CPU_FLAGTYPE_CARRY || type == CPU_FLAGTYPE_OVERFLOW)
+		return flag_from_add(cpu, type, ZEXT64(LOAD(cpu->ptr_flags_op)),
+			LOAD(cpu->ptr_flags_src1), LOAD(cpu->ptr_flags_src2),
+			LOAD(cpu->ptr_flags_sum), bb);
+	return flag_from_result(cpu, type, LOAD(cpu->ptr_flags_result), bb);
+}
+
+Value *
+arch_get_flag(cpu_t *cpu, Value *ptr_flag, BasicBlock *bb)
+{
+	char type;
+	Value *ptr_lazy = lazy_flag_bit(cpu, ptr_flag, &type);
+
+	if (ptr_lazy == NULL)
+		return LOAD(ptr_flag);
+	return SELECT(LOAD(ptr_lazy), lazy_flag_value(cpu, type, bb),
+		LOAD(ptr_flag));
+}
+
+void
+arch_set_flag(cpu_t *cpu, Value *ptr_flag, Value *v, BasicBlock *bb)
+{
+	char type;
+	Value *ptr_lazy = lazy_flag_bit(cpu, ptr_flag, &type);
+
+	LET1(ptr_flag, v);
+	if (ptr_lazy != NULL)
+		LET1(ptr_lazy, FALSE);
+}
+
+/*
+ * flags that are lazy but not among 'types' still need the old
+ * state, so they are made explicit before it is overwritten
+ */
+static void
+lazy_flags_keep(cpu_t *cpu, Value **ptr_flags, size_t count, const char *types, BasicBlock *bb)
+{
+	for (size_t i = 0; i < count; i++) {
+		char type;
+		Value *ptr_lazy = lazy_flag_bit(cpu, ptr_flags[i], &type);
+		if (ptr_lazy == NULL || strchr(types, type))
+			continue;
+		LET1(ptr_flags[i], arch_get_flag(cpu, ptr_flags[i], bb));
+		LET1(ptr_lazy, FALSE);
+	}
+}
+
+static void
+lazy_flags_mark(cpu_t *cpu, Value **ptr_flags, size_t count, const char *types, BasicBlock *bb)
+{
+	for (size_t i = 0; i < count; i++) {
+		char type;
+		Value *ptr_lazy = lazy_flag_bit(cpu, ptr_flags[i], &type);
+		if (ptr_lazy != NULL && strchr(types, type))
+			LET1(ptr_lazy, TRUE);
+	}
+}
+
+/*
+ * 'v' is the result of an operation that sets the flags of the
+ * given 'types' (e.g. "NZ"), which are derived from it lazily.
+ */
+void
+arch_set_flags_result(cpu_t *cpu, Value *v, const char *types, BasicBlock *bb)
+{
+	Value *ptr_flags[] = { cpu->ptr_N, cpu->ptr_Z, cpu->ptr_P };
+	const char flag_types[] = { CPU_FLAGTYPE_NEGATIVE, CPU_FLAGTYPE_ZERO, CPU_FLAGTYPE_PARITY };
+	size_t i;
+
+	if (cpu->ptr_flags_result == NULL || SIZE(v) > LAZY_RESULT_WIDTH) {
+		for (i = 0; i < 3; i++)
+			if (ptr_flags[i] != NULL && strchr(types, flag_types[i]))
+				arch_set_flag(cpu, ptr_flags[i],
+					flag_from_result(cpu, flag_types[i], v, bb), bb);
+		return;
+	}
+
+	lazy_flags_keep(cpu, ptr_flags, 3, types, bb);
+	if (SIZE(v) < LAZY_RESULT_WIDTH)
+		v = SEXT(LAZY_RESULT_WIDTH, v);
+	LET1(cpu->ptr_flags_result, v);
+	lazy_flags_mark(cpu, ptr_flags, 3, types, bb);
+}
+
+/*
+ * a + b + c (carry in, i1) sets the flags of the given 'types'
+ * ("C", "V" or "CV"), which are derived from it lazily.
+ */
+void
+arch_set_flags_add(cpu_t *cpu, Value *a, Value *b, Value *c, const char *types, BasicBlock *bb)
+{
+	Value *ptr_flags[] = { cpu->ptr_C, cpu->ptr_V };
+	const char flag_types[] = { CPU_FLAGTYPE_CARRY, CPU_FLAGTYPE_OVERFLOW };
+	size_t width = SIZE(a);
+	size_t i;
+
+	if (width > LAZY_OP_ADD_MAX) {
+		//XXX TODO use llvm.uadd.with.overflow.*
+		printf("TODO: %s() can't do more than %d bits yet!\n", __func__, LAZY_OP_ADD_MAX);
+		exit(1);
+	}
+
+	a = ZEXT64(a);
+	b = ZEXT64(b);
+	Value *sum = ADD(ADD(a, b), ZEXT64(c));
+
+	if (cpu->ptr_flags_op == NULL) {
+		for (i = 0; i < 2; i++)
+			if (ptr_flags[i] != NULL && strchr(types, flag_types[i]))
+				arch_set_flag(cpu, ptr_flags[i],
+					flag_from_add(cpu, flag_types[i], CONST64(width), a, b, sum, bb), bb);
+		return;
+	}
+
+	lazy_flags_keep(cpu, ptr_flags, 2, types, bb);
+	LET1(cpu->ptr_flags_op, CONST8(width));
+	LET1(cpu->ptr_flags_src1, a);
+	LET1(cpu->ptr_flags_src2, b);
+	LET1(cpu->ptr_flags_sum, sum);
+	lazy_flags_mark(cpu, ptr_flags, 2, types, bb);
 }
 
 // FP
@@ -442,8 +738,7 @@ arch_debug_me(cpu_t *cpu, BasicBlock *bb)
 		return;
 
 	IntegerType *intptr_type = cpu->exec_engine->getDataLayout()->getIntPtrType(_CTX());
-	Constant *v_cpu = ConstantInt::get(intptr_type, (uintptr_t)cpu);
-	Value *v_cpu_ptr = ConstantExpr::getIntToPtr(v_cpu, PointerType::getUnqual(intptr_type));
+	Value *v_cpu_ptr = get_host_pointer(cpu, cpu, intptr_type);
 
 	// XXX synchronize cpu context!
 	CallInst::Create(cpu->ptr_func_debug, v_cpu_ptr, "", bb);
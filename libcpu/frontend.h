@@ -10,7 +10,7 @@ Value *arch_load16_aligned(cpu_t *cpu, Value *addr, BasicBlock *bb);
 void arch_store8(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb);
 void arch_store16(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb);
 
-Value *arch_store(Value *v, Value *a, BasicBlock *bb);
+Value *arch_store(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb);
 
 void arch_branch(bool flag_state, BasicBlock *target1, BasicBlock *target2, Value *flag, BasicBlock *bb);
 void arch_jump(BasicBlock *bb, BasicBlock *bb_target);
@@ -20,13 +20,19 @@ void arch_decode_bit(Value *flags, Value *bit, int shift, int width, BasicBlock
 
 Value *arch_flags_encode(cpu_t *cpu, BasicBlock *bb);
 void arch_flags_decode(cpu_t *cpu, Value *flags, BasicBlock *bb);
+void arch_flags_lazy_init(cpu_t *cpu, BasicBlock *bb);
+Value *arch_get_flag(cpu_t *cpu, Value *ptr_flag, BasicBlock *bb);
+void arch_set_flag(cpu_t *cpu, Value *ptr_flag, Value *v, BasicBlock *bb);
+void arch_set_flags_result(cpu_t *cpu, Value *v, const char *types, BasicBlock *bb);
+void arch_set_flags_add(cpu_t *cpu, Value *a, Value *b, Value *c, const char *types, BasicBlock *bb);
+bool flag_is_live(cpu_t *cpu, addr_t pc, char type);
 
 Value *arch_bswap(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb);
 Value *arch_ctlz(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb);
 Value *arch_cttz(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb);
 
 Value *arch_shiftrotate(cpu_t *cpu, Value *dst, Value *src, bool left, bool rotate, BasicBlock *bb);
-Value *arch_adc(cpu_t *cpu, Value *dst, Value *src, Value *v, bool plus_carry, bool plus_one, BasicBlock *bb);
+Value *arch_adc(cpu_t *cpu, Value *dst, Value *src, Value *v, bool plus_carry, bool plus_one, const char *types, BasicBlock *bb);
 
 /* FPU */
 Value *arch_cast_fp32(cpu_t *cpu, Value *v, BasicBlock *bb);
@@ -53,7 +59,7 @@ uint32_t RAM32LE(uint8_t *RAM, addr_t a);
 #define SIZE(x) (x->getType()->getPrimitiveSizeInBits())
 
 #define LOAD(a) new LoadInst(a, "", false, bb)
-#define STORE(v,a) arch_store(v, a, bb)
+#define STORE(v,a) arch_store(cpu, v, a, bb)
 
 #define CONSTs(s,v) ConstantInt::get(getIntegerType(s), v)
 #define CONST1(v) CONSTs(1,v)
@@ -117,7 +123,7 @@ uint32_t RAM32LE(uint8_t *RAM, addr_t a);
 
 /* more complex operations */
 #define SHIFTROTATE(dst,src,left,rotate) arch_shiftrotate(cpu,dst,src,left,rotate,bb)
-#define ADC(dst,src,v,plus_carry,plus_one) arch_adc(cpu,dst,src,v,plus_carry,plus_one,bb)
+#define ADC(dst,src,v,plus_carry,plus_one,types) arch_adc(cpu,dst,src,v,plus_carry,plus_one,types,bb)
 
 /* floating point */
 #define FPCONSTs(s,v) ConstantFP::get(getFloatType(s), v)
@@ -221,18 +227,22 @@ uint32_t RAM32LE(uint8_t *RAM, addr_t a);
 #define FFC32(v) FFC(32,v)
 #define FFC64(v) FFC(64,v)
 
-/* flags */
-#define SET_N(a) { Value *t = a; LET1(cpu->ptr_N, ICMP_SLT(t, CONSTs(SIZE(t), 0))); }
-#define SET_Z(a) { Value *t = a; LET1(cpu->ptr_Z, ICMP_EQ(t, CONSTs(SIZE(t), 0))); }
-#define SET_NZ(a) { Value *t2 = a; SET_N(t2); SET_Z(t2); }
-#define CC_EQ LOAD(cpu->ptr_Z)
-#define CC_NE NOT(LOAD(cpu->ptr_Z))
-#define CC_CS LOAD(cpu->ptr_C)
-#define CC_CC NOT(LOAD(cpu->ptr_C))
-#define CC_MI LOAD(cpu->ptr_N)
-#define CC_PL NOT(LOAD(cpu->ptr_N))
-#define CC_VS LOAD(cpu->ptr_V)
-#define CC_VC NOT(LOAD(cpu->ptr_V))
+/* flags; N, Z, P, C and V of the generic layout are lazy, see frontend.cpp */
+#define FLAG(p) arch_get_flag(cpu, p, bb)
+#define LET_FLAG(p,v) arch_set_flag(cpu, p, v, bb)
+#define SET_N(a) { Value *t = a; LET_FLAG(cpu->ptr_N, ICMP_SLT(t, CONSTs(SIZE(t), 0))); }
+#define SET_Z(a) { Value *t = a; LET_FLAG(cpu->ptr_Z, ICMP_EQ(t, CONSTs(SIZE(t), 0))); }
+#define SET_NZ(a) arch_set_flags_result(cpu, a, "NZ", bb)
+#define SET_NZP(a) arch_set_flags_result(cpu, a, "NZP", bb)
+#define SET_CV_ADD(a,b,c) arch_set_flags_add(cpu, a, b, c, "CV", bb)
+#define CC_EQ FLAG(cpu->ptr_Z)
+#define CC_NE NOT(FLAG(cpu->ptr_Z))
+#define CC_CS FLAG(cpu->ptr_C)
+#define CC_CC NOT(FLAG(cpu->ptr_C))
+#define CC_MI FLAG(cpu->ptr_N)
+#define CC_PL NOT(FLAG(cpu->ptr_N))
+#define CC_VS FLAG(cpu->ptr_V)
+#define CC_VC NOT(FLAG(cpu->ptr_V))
 
 /* host */
 #define RAM32(RAM,a) RAM32BE(RAM,a)
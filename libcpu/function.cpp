@@ -17,6 +17,9 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "frontend.h" // XXX for arch_flags_encode() / arch_flags_decode()
+#include "smc.h"
+#include "call.h"
+#include "pc.h"
 
 //////////////////////////////////////////////////////////////////////
 // function
@@ -175,16 +178,26 @@ emit_decode_reg(cpu_t *cpu, BasicBlock *bb)
 		cpu->info.register_size[CPU_REG_FPR], cpu->in_ptr_fpr,
 		cpu->ptr_fpr, bb);
 
-	// PC pointer.
+	// PC pointer; the unit works on a copy, see pc.cpp
 	IntegerType *intptr_type = cpu->exec_engine->getDataLayout()->getIntPtrType(_CTX());
-	Constant *v_pc = ConstantInt::get(intptr_type, (uintptr_t)cpu->rf.pc);
-	cpu->ptr_PC = ConstantExpr::getIntToPtr(v_pc, PointerType::getUnqual(getIntegerType(cpu->info.address_size)));
-	cpu->ptr_PC->setName("pc");
+	PointerType *type_ppc = PointerType::getUnqual(getIntegerType(cpu->info.address_size));
+	uintptr_t pc_offset;
+	if (pc_in_grf(cpu, &pc_offset)) {
+		// a register (r15 on ARM): address it through grf, which is noalias
+		Value *v = new BitCastInst(cpu->ptr_grf, PointerType::getUnqual(getIntegerType(8)), "", bb);
+		v = GetElementPtrInst::Create(v, ConstantInt::get(intptr_type, pc_offset), "", bb);
+		cpu->in_ptr_PC = new BitCastInst(v, type_ppc, "", bb);
+	} else {
+		cpu->in_ptr_PC = get_host_pointer(cpu, cpu->rf.pc, type_ppc->getElementType());
+	}
+	cpu->ptr_PC = new AllocaInst(getIntegerType(cpu->info.address_size), "pc", bb);
+	new StoreInst(new LoadInst(cpu->in_ptr_PC, "", false, bb), cpu->ptr_PC, false, bb);
 
 	// flags
 	if (cpu->info.psr_size != 0) {
 		// declare flags
 		cpu_flags_layout_t const *flags_layout = cpu->info.flags_layout;
+		cpu->ptr_N = cpu->ptr_V = cpu->ptr_Z = cpu->ptr_C = cpu->ptr_P = NULL;
 		for (size_t i = 0; i < cpu->info.flags_count; i++) {
 			Value *f = new AllocaInst(getIntegerType(1), flags_layout[i].name,
 					bb);
@@ -203,8 +216,12 @@ emit_decode_reg(cpu_t *cpu, BasicBlock *bb)
 				case CPU_FLAGTYPE_CARRY:
 					cpu->ptr_C = f;
 					break;
+				case CPU_FLAGTYPE_PARITY:
+					cpu->ptr_P = f;
+					break;
 			}
 		}
+		arch_flags_lazy_init(cpu, bb);
 
 		// decode P
 		Value *flags = new LoadInst(cpu->ptr_xr[0], "", false, bb);
@@ -250,7 +267,7 @@ spill_fp_reg_state_helper(cpu_t *cpu, uint32_t count, uint32_t width,
 #endif
 }
 
-static void
+void
 spill_reg_state(cpu_t *cpu, BasicBlock *bb)
 {
 	// frontend specific part.
@@ -277,6 +294,68 @@ spill_reg_state(cpu_t *cpu, BasicBlock *bb)
 		cpu->ptr_fpr, bb);
 }
 
+static void
+reload_reg_state_helper(uint32_t count, Value **in_ptr_r, Value **ptr_r,
+	BasicBlock *bb)
+{
+#ifdef OPT_LOCAL_REGISTERS
+	for (uint32_t i = 0; i < count; i++) {
+		LoadInst* v = new LoadInst(in_ptr_r[i], "", false, bb);
+		new StoreInst(v, ptr_r[i], false, bb);
+	}
+#endif
+}
+
+static void
+reload_fp_reg_state_helper(cpu_t *cpu, uint32_t count, uint32_t width,
+	Value **in_ptr_r, Value **ptr_r, BasicBlock *bb)
+{
+#ifdef OPT_LOCAL_REGISTERS
+	for (uint32_t i = 0; i < count; i++) {
+		if ((width == 80 && (cpu->flags & CPU_FLAG_FP80) == 0) ||
+			(width == 128 && (cpu->flags & CPU_FLAG_FP128) == 0)) {
+			LoadInst* v = new LoadInst(in_ptr_r[i*2+0], "", false, 0, bb);
+			new StoreInst(v, ptr_r[i*2+0], false, 0, bb);
+
+			v = new LoadInst(in_ptr_r[i*2+1], "", false, 0, bb);
+			new StoreInst(v, ptr_r[i*2+1], false, 0, bb);
+		} else {
+			LoadInst* v = new LoadInst(in_ptr_r[i], "", false,
+				fp_alignment(width), bb);
+			new StoreInst(v, ptr_r[i], false, fp_alignment(width), bb);
+		}
+	}
+#endif
+}
+
+/*
+ * the opposite of spill_reg_state(): the register file has been
+ * changed behind our back, by a host call (see call.cpp). Not for
+ * frontends with a decode hook of their own.
+ */
+void
+reload_reg_state(cpu_t *cpu, BasicBlock *bb)
+{
+	// GPRs
+	reload_reg_state_helper(cpu->info.register_count[CPU_REG_GPR],
+		cpu->in_ptr_gpr, cpu->ptr_gpr, bb);
+
+	// XRs
+	reload_reg_state_helper(cpu->info.register_count[CPU_REG_XR],
+		cpu->in_ptr_xr, cpu->ptr_xr, bb);
+
+	// FPRs
+	reload_fp_reg_state_helper(cpu, cpu->info.register_count[CPU_REG_FPR],
+		cpu->info.register_size[CPU_REG_FPR], cpu->in_ptr_fpr,
+		cpu->ptr_fpr, bb);
+
+	// flags
+	if (cpu->info.psr_size != 0) {
+		Value *flags = new LoadInst(cpu->ptr_xr[0], "", false, bb);
+		arch_flags_decode(cpu, flags, bb);
+	}
+}
+
 Function*
 cpu_create_function(cpu_t *cpu, const char *name,
 	BasicBlock **p_bb_ret,
@@ -325,6 +404,11 @@ cpu_create_function(cpu_t *cpu, const char *name,
 		name, cpu->mod);				/* Name */
 	func->setCallingConv(CallingConv::C);
 	func->addAttribute(1U, Attribute::NoCapture);
+	// guest RAM and the register files never overlap, see alias.cpp;
+	// a PC inside grf is addressed through it, see emit_decode_reg()
+	func->addAttribute(1U, Attribute::NoAlias);
+	func->addAttribute(2U, Attribute::NoAlias);
+	func->addAttribute(3U, Attribute::NoAlias);
 	func->addAttribute(4294967295U, Attribute::NoUnwind);
 
 	// args
@@ -365,6 +449,58 @@ cpu_create_function(cpu_t *cpu, const char *name,
 	// return
 	BranchInst::Create(bb_ret, bb_trap);
 
+	// create link basicblock: continue in another unit, see link.cpp
+	if (!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))) {
+		IntegerType *intptr_type = cpu->exec_engine->getDataLayout()->getIntPtrType(_CTX());
+		cpu->ptr_link_fp = new AllocaInst(func->getType(), "link_fp", label_entry);
+		cpu->ptr_ibtc_site = new AllocaInst(intptr_type, "ibtc_site", label_entry);
+		new StoreInst(ConstantInt::get(intptr_type, 0), cpu->ptr_ibtc_site, false, label_entry);
+		BasicBlock *bb_link = BasicBlock::Create(_CTX(), "link", func, 0);
+		BasicBlock *bb_link_call = BasicBlock::Create(_CTX(), "link_call", func, 0);
+		// the tail call is only a hint: after LIMIT_LINK_DEPTH links
+		// without cpu_run(), return there to unwind the host stack
+		Value *ptr_depth = get_host_pointer(cpu, &cpu->link_depth, getIntegerType(32));
+		Value *depth = new LoadInst(ptr_depth, "", false, bb_link);
+		new StoreInst(BinaryOperator::Create(Instruction::Add, depth,
+			ConstantInt::get(getIntegerType(32), 1), "", bb_link), ptr_depth, false, bb_link);
+		Value *shallow = new ICmpInst(*bb_link, ICmpInst::ICMP_ULT, depth,
+			ConstantInt::get(getIntegerType(32), LIMIT_LINK_DEPTH), "");
+		BranchInst::Create(bb_link_call, bb_ret, shallow, bb_link);
+
+		spill_reg_state(cpu, bb_link_call);
+		std::vector<Value*> link_args;
+		link_args.push_back(cpu->ptr_RAM);
+		link_args.push_back(cpu->ptr_grf);
+		link_args.push_back(cpu->ptr_frf);
+		link_args.push_back(cpu->ptr_func_debug);
+		Value *link_fp = new LoadInst(cpu->ptr_link_fp, "", false, bb_link_call);
+		CallInst *link_call = CallInst::Create(link_fp, link_args, "", bb_link_call);
+		// same signature and arguments, so this becomes a jump
+		link_call->setTailCall();
+		ReturnInst::Create(_CTX(), link_call, bb_link_call);
+		cpu->bb_link = bb_link;
+		// a pending write to code must be handled by cpu_run() first
+		if (smc_enabled(cpu)) {
+			cpu->bb_link = BasicBlock::Create(_CTX(), "link_smc", func, 0);
+			emit_smc_guard(cpu, cpu->bb_link, bb_ret, bb_link);
+		}
+	} else {
+		cpu->ptr_link_fp = NULL;
+		cpu->ptr_ibtc_site = NULL;
+		cpu->bb_link = NULL;
+	}
+
+	// create guest return basicblock: leave a host call, see call.cpp
+	if (call_enabled(cpu)) {
+		cpu->bb_guest_ret = BasicBlock::Create(_CTX(), "guest_ret", func, 0);
+		new StoreInst(ConstantInt::get(XgetType(Int32Ty), JIT_RETURN_GUESTRET),
+			exit_code, false, 0, cpu->bb_guest_ret);
+		BranchInst::Create(bb_ret, cpu->bb_guest_ret);
+	} else
+		cpu->bb_guest_ret = NULL;
+
+	cpu->smc_stores = false;
+
 	*p_bb_ret = bb_ret;
 	*p_bb_trap = bb_trap;
 	*p_label_entry = label_entry;
@@ -1 +1,3 @@
+void spill_reg_state(cpu_t *cpu, BasicBlock *bb);
+void reload_reg_state(cpu_t *cpu, BasicBlock *bb);
 Function *cpu_create_function(cpu_t *cpu, const char *name, BasicBlock **p_bb_ret, BasicBlock **p_bb_trap, BasicBlock **p_label_entry);
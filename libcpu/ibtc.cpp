@@ -0,0 +1,143 @@
+/*
+ * libcpu: ibtc.cpp
+ *
+ * Indirect branch target cache. Every computed branch (returns,
+ * jumps through registers, calls with an unknown target) gets
+ * its own compare chain against the targets it went to most
+ * recently, before it falls back to the dispatch switch. The
+ * targets are recorded by the generated code on a miss and used
+ * the next time the unit is translated.
+ *
+ * Until then, and for targets in other units, every site also has
+ * a single entry cache that the code checks at run time: the last
+ * target the lookup found in another unit, and its entry. A hit
+ * links there directly, without the dispatch switch and the lookup.
+ */
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "tag.h"
+#include "basicblock.h"
+#include "entry.h"
+#include "ibtc.h"
+
+/* the targets are kept in a std::map, so they have a stable address */
+static ibtc_site_t *
+ibtc_get_site(cpu_t *cpu, addr_t pc)
+{
+	ibtcsite_map::iterator i = cpu->ibtc_sites.find(pc);
+	if (i == cpu->ibtc_sites.end()) {
+		ibtc_site_t site;
+		for (int j = 0; j < IBTC_WAYS; j++)
+			site.target[j] = NEW_PC_NONE;
+		site.cache_pc = NEW_PC_NONE;
+		site.cache_fp = NULL;
+		i = cpu->ibtc_sites.insert(std::make_pair(pc, site)).first;
+	}
+	return &i->second;
+}
+
+static Value *
+ibtc_get_target_pointer(cpu_t *cpu, ibtc_site_t *site, int way)
+{
+	return get_host_pointer(cpu, &site->target[way], getIntegerType(64));
+}
+
+/*
+ * Look up the entry for 'pc' a computed branch at 'site' (or NULL:
+ * anything else) goes to; called by the generated code when the
+ * target isn't in the current unit. Fills in the site's cache.
+ */
+void *
+ibtc_lookup(cpu_t *cpu, ibtc_site_t *site, addr_t pc)
+{
+	void *fp = entry_lookup(cpu, pc);
+
+	if (site != NULL && fp != NULL) {
+		site->cache_pc = pc;
+		site->cache_fp = fp;
+	}
+	return fp;
+}
+
+/* empty all caches; their entries may be gone */
+void
+ibtc_clear_caches(cpu_t *cpu)
+{
+	for (ibtcsite_map::iterator i = cpu->ibtc_sites.begin(); i != cpu->ibtc_sites.end(); i++) {
+		i->second.cache_pc = NEW_PC_NONE;
+		i->second.cache_fp = NULL;
+	}
+}
+
+/*
+ * Create the basic block that a computed branch at 'pc' jumps
+ * to once it has stored the new PC.
+ */
+BasicBlock *
+create_ibtc_basicblock(cpu_t *cpu, addr_t pc, BasicBlock *bb_dispatch,
+	BasicBlock *bb_ret)
+{
+	ibtc_site_t *site = ibtc_get_site(cpu, pc);
+	BasicBlock *bb_ibtc = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_INDIRECT);
+	BasicBlock *bb = bb_ibtc;
+	IntegerType *type_pc = getIntegerType(cpu->info.address_size);
+	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb);
+
+	// most recent target first
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		addr_t target = site->target[i];
+		if (!is_inside_code_area(cpu, target))
+			continue;
+
+		// a block of this unit, or a link to another unit
+		BasicBlock *bb_target = const_cast<BasicBlock*>(lookup_basicblock(cpu,
+			cpu->cur_func, target, bb_ret, BB_TYPE_NORMAL));
+		BasicBlock *bb_miss = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_INDIRECT);
+		Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v_pc,
+			ConstantInt::get(type_pc, target), "");
+		BranchInst::Create(bb_target, bb_miss, hit, bb);
+		bb = bb_miss;
+	}
+
+	// the last target in another unit: link there
+	Value *v_target = CastInst::CreateZExtOrBitCast(v_pc, getIntegerType(64), "", bb);
+	if (cpu->bb_link != NULL) {
+		BasicBlock *bb_cached = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_INDIRECT);
+		BasicBlock *bb_miss = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_INDIRECT);
+		Value *v_cache_pc = new LoadInst(get_host_pointer(cpu, &site->cache_pc,
+			getIntegerType(64)), "", false, bb);
+		Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v_target, v_cache_pc, "");
+		BranchInst::Create(bb_cached, bb_miss, hit, bb);
+
+		Value *fp = new LoadInst(get_host_pointer(cpu, &site->cache_fp,
+			cpu->cur_func->getType()), "", false, bb_cached);
+		new StoreInst(fp, cpu->ptr_link_fp, false, bb_cached);
+		BranchInst::Create(cpu->bb_link, bb_cached);
+
+		// the lookup fills in the cache if the target isn't in this unit
+		bb = bb_miss;
+		new StoreInst(get_host_address(cpu, site),
+			cpu->ptr_ibtc_site, false, bb);
+	}
+
+	// miss: remember the target, unless it's the most recent one already
+	Value *v_mru = new LoadInst(ibtc_get_target_pointer(cpu, site, 0), "", false, bb);
+	Value *is_mru = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v_target, v_mru, "");
+	for (int i = IBTC_WAYS - 1; i > 0; i--) {
+		Value *v_old = new LoadInst(ibtc_get_target_pointer(cpu, site, i), "", false, bb);
+		Value *v_prev = new LoadInst(ibtc_get_target_pointer(cpu, site, i - 1), "", false, bb);
+		Value *v_new = SelectInst::Create(is_mru, v_old, v_prev, "", bb);
+		new StoreInst(v_new, ibtc_get_target_pointer(cpu, site, i), false, bb);
+	}
+	new StoreInst(v_target, ibtc_get_target_pointer(cpu, site, 0), false, bb);
+	BranchInst::Create(bb_dispatch, bb);
+
+	return bb_ibtc;
+}
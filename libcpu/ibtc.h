@@ -0,0 +1,3 @@
+BasicBlock *create_ibtc_basicblock(cpu_t *cpu, addr_t pc, BasicBlock *bb_dispatch, BasicBlock *bb_ret);
+void *ibtc_lookup(cpu_t *cpu, ibtc_site_t *site, addr_t pc);
+void ibtc_clear_caches(cpu_t *cpu);
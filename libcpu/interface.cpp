@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <set>
 
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/ExecutionEngine/JIT.h"
@@ -22,7 +23,17 @@
 #include "translate_singlestep.h"
 #include "translate_singlestep_bb.h"
 #include "function.h"
+#include "liveness.h"
+#include "alias.h"
+#include "pc.h"
 #include "optimize.h"
+#include "entry.h"
+#include "region.h"
+#include "shadow.h"
+#include "codecache.h"
+#include "smc.h"
+#include "async.h"
+#include "profile.h"
 #include "stat.h"
 
 /* architecture descriptors */
@@ -120,14 +131,23 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 	cpu->code_start = 0;
 	cpu->code_end = 0;
 	cpu->code_entry = 0;
-	cpu->tag = NULL;
 
-	uint32_t i;
-	for (i = 0; i < sizeof(cpu->func)/sizeof(*cpu->func); i++)
-		cpu->func[i] = NULL;
-	for (i = 0; i < sizeof(cpu->fp)/sizeof(*cpu->fp); i++)
-		cpu->fp[i] = NULL;
-	cpu->functions = 0;
+	cpu->tags_dirty = false;
+	cpu->ptr_link_fp = NULL;
+	cpu->ptr_ibtc_site = NULL;
+	cpu->bb_link = NULL;
+	cpu->bb_guest_ret = NULL;
+	cpu->call_depth = 0;
+	cpu->link_depth = 0;
+	cpu->ptr_flags_result = NULL;
+	cpu->ptr_N_lazy = cpu->ptr_Z_lazy = cpu->ptr_P_lazy = NULL;
+	cpu->ptr_C_lazy = cpu->ptr_V_lazy = NULL;
+	cpu->ptr_flags_op = cpu->ptr_flags_src1 = cpu->ptr_flags_src2 = NULL;
+	cpu->ptr_flags_sum = NULL;
+	entry_init(cpu);
+	cpu->async = NULL;
+	shadow_clear(cpu);
+	smc_init(cpu);
 
 	cpu->flags_codegen = CPU_CODEGEN_OPTIMIZE;
 	cpu->flags_debug = CPU_DEBUG_NONE;
@@ -136,6 +156,7 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 
 	// init the frontend
 	cpu->f.init(cpu, &cpu->info, &cpu->rf);
+	tag_init(cpu);
 
 	assert(is_valid_gpr_size(cpu->info.register_size[CPU_REG_GPR]) &&
 		"the specified GPR size is not guaranteed to work");
@@ -174,7 +195,8 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 	}
 
 	if (cpu->info.psr_size != 0) {
-		cpu->ptr_FLAG = (Value **)calloc(cpu->info.flags_count,
+		/* indexed by the shift of the flag */
+		cpu->ptr_FLAG = (Value **)calloc(cpu->info.psr_size,
 				sizeof(Value*));
 		assert(cpu->ptr_FLAG != NULL);
 	}
@@ -202,6 +224,9 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 			^ IS_LITTLE_ENDIAN(cpu))
 		cpu->flags |= CPU_FLAG_SWAPMEM;
 
+	codecache_init(cpu);
+	optimize_init(cpu);
+
 	cpu->timer_total[TIMER_TAG] = 0;
 	cpu->timer_total[TIMER_FE] = 0;
 	cpu->timer_total[TIMER_BE] = 0;
@@ -213,15 +238,18 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 void
 cpu_free(cpu_t *cpu)
 {
+	/* the compile thread may still be using the frontend's state */
+	async_stop(cpu);
 	if (cpu->f.done != NULL)
 		cpu->f.done(cpu);
 	if (cpu->exec_engine != NULL) {
-		if (cpu->cur_func != NULL) {
-			cpu->exec_engine->freeMachineCodeForFunction(cpu->cur_func);
-			cpu->cur_func->eraseFromParent();
-		}
+		codecache_done(cpu);
 		delete cpu->exec_engine;
 	}
+	optimize_done(cpu);
+	entry_done(cpu);
+	smc_done(cpu);
+	tag_done(cpu);
 	if (cpu->ptr_FLAG != NULL)
 		free(cpu->ptr_FLAG);
 	if (cpu->in_ptr_fpr != NULL)
@@ -264,22 +292,47 @@ cpu_set_flags_hint(cpu_t *cpu, uint32_t f)
 	cpu->flags_hint = f;
 }
 
-void
+/* returns the number of newly discovered instructions */
+uint32_t
 cpu_tag(cpu_t *cpu, addr_t pc)
 {
+	uint32_t count;
+
 	update_timing(cpu, TIMER_TAG, true);
-	tag_start(cpu, pc);
+	count = tag_start(cpu, pc);
 	update_timing(cpu, TIMER_TAG, false);
+	return count;
 }
 
-static void
-cpu_translate_function(cpu_t *cpu)
+/*
+ * Limit the instructions a single cpu_tag() discovers, to bound
+ * its latency; the rest is tagged when execution gets there.
+ */
+void
+cpu_set_tag_budget(cpu_t *cpu, uint32_t instructions)
+{
+	cpu->tag_budget = instructions;
+}
+
+/*
+ * translate one unit, up to the optimizer: the given region, or
+ * the code at the current PC when single stepping (region == NULL).
+ * Tier 0 code counts its entries and isn't optimized, tier 2
+ * code is hot and gets optimized at CPU_OPT_MAX, using the
+ * 'profile' of its tier 0 predecessor if there is one.
+ * Returns the optimization level of the unit, or -1.
+ */
+static int
+cpu_translate_tier(cpu_t *cpu, const addr_list *region, uint8_t tier,
+	const profile_map *profile)
 {
 	BasicBlock *bb_ret, *bb_trap, *label_entry, *bb_start;
+	cpu_unit_t *unit;
 
 	/* create function and fill it with std basic blocks */
-	cpu->cur_func = cpu_create_function(cpu, "jitmain", &bb_ret, &bb_trap, &label_entry);
-	cpu->func[cpu->functions] = cpu->cur_func;
+	unit = codecache_new_unit(cpu,
+		cpu_create_function(cpu, "jitmain", &bb_ret, &bb_trap, &label_entry));
+	unit->tier = tier;
 
 	/* TRANSLATE! */
 	update_timing(cpu, TIMER_FE, true);
@@ -288,22 +341,47 @@ cpu_translate_function(cpu_t *cpu)
 	} else if (cpu->flags_debug & CPU_DEBUG_SINGLESTEP_BB) {
 		bb_start = cpu_translate_singlestep_bb(cpu, bb_ret, bb_trap);
 	} else {
-		bb_start = cpu_translate_all(cpu, bb_ret, bb_trap);
+		bb_start = cpu_translate_all(cpu, *region, profile, bb_ret, bb_trap);
 	}
 	update_timing(cpu, TIMER_FE, false);
 
 	/* finish entry basicblock */
+	codecache_emit_reference(cpu, label_entry);
+	if (tier == 0 && cpu->hot_threshold != 0)
+		label_entry = codecache_emit_counter(cpu, label_entry, bb_ret);
 	BranchInst::Create(bb_start, label_entry);
 
+	if (profile != NULL)
+		profile_apply(cpu, cpu->cur_func, *profile);
+
+	/* only load and store the registers the unit uses */
+	pc_write_back(cpu, cpu->cur_func);
+	liveness_prune_regs(cpu, cpu->cur_func);
+	alias_annotate(cpu, cpu->cur_func);
+
 	/* make sure everything is OK */
 	verifyFunction(*cpu->cur_func, PrintMessageAction);
 
 	if (cpu->flags_debug & CPU_DEBUG_PRINT_IR)
 		cpu->mod->dump();
 
-	if (cpu->flags_codegen & CPU_CODEGEN_OPTIMIZE) {
+	if (tier > 0 && (cpu->flags_codegen & CPU_CODEGEN_OPTIMIZE))
+		return tier == 2 ? CPU_OPT_MAX : cpu->opt_level;
+	return -1;
+}
+
+/* compile one unit right away, see cpu_translate_tier() */
+static cpu_unit_t *
+cpu_compile_tier(cpu_t *cpu, const addr_list *region, uint8_t tier,
+	const profile_map *profile)
+{
+	int level = cpu_translate_tier(cpu, region, tier, profile);
+	cpu_unit_t *unit = cpu->cur_unit;
+	uint64_t opt_time = 0;
+
+	if (level >= 0) {
 		LOG("*** Optimizing...");
-		optimize(cpu);
+		opt_time = optimize(cpu, level);
 		LOG("done.\n");
 		if (cpu->flags_debug & CPU_DEBUG_PRINT_IR_OPTIMIZED)
 			cpu->mod->dump();
@@ -311,21 +389,185 @@ cpu_translate_function(cpu_t *cpu)
 
 	LOG("*** Translating...");
 	update_timing(cpu, TIMER_BE, true);
-	cpu->fp[cpu->functions] = cpu->exec_engine->getPointerToFunction(cpu->cur_func);
+	unit->fp = cpu->exec_engine->getPointerToFunction(cpu->cur_func);
 	update_timing(cpu, TIMER_BE, false);
 	LOG("done.\n");
 
-	cpu->functions++;
+	if (level >= 0)
+		optimize_account(cpu, level, opt_time, unit->code_size);
+
+	return unit;
+}
+
+/* every basic block of the current unit has a dispatch case */
+static void
+cpu_unit_blocks(cpu_t *cpu, addr_list &entries)
+{
+	bbaddr_map &bb_addr = cpu->func_bb[cpu->cur_func];
+	bbaddr_map::const_iterator it;
+
+	for (it = bb_addr.begin(); it != bb_addr.end(); it++)
+		entries.push_back(it->first);
+}
+
+static void
+cpu_install_unit(cpu_t *cpu, cpu_unit_t *unit, const addr_list &entries)
+{
+	for (addr_list::const_iterator it = entries.begin(); it != entries.end(); it++)
+		codecache_add_entry(cpu, unit, *it);
+}
+
+/*
+ * Translate the code of 'old' again at 'tier', into a pending
+ * unit that the compile thread optimizes and compiles. 'old'
+ * keeps running until cpu_run() installs the new unit instead.
+ */
+static void
+cpu_queue_tier(cpu_t *cpu, cpu_unit_t *old, uint8_t tier,
+	const profile_map *profile)
+{
+	addr_list region(old->entries);
+	Module *mod = cpu->mod;
+	async_job_t *job = new async_job_t;
+
+	async_start(cpu);
+
+	/* the unit gets a module of its own, to hand it over as a whole */
+	cpu->mod = new Module(cpu->info.name, _CTX());
+	job->level = cpu_translate_tier(cpu, &region, tier, profile);
+	job->pipeline = job->level >= 0 ? optimize_pipeline(cpu, job->level) : NULL;
+	job->dump = !!(cpu->flags_debug & CPU_DEBUG_PRINT_IR_OPTIMIZED);
+	job->unit = cpu->cur_unit;
+	job->old = old;
+	cpu_unit_blocks(cpu, job->entries);
+
+	/* the IR is gone once it is queued */
+	cpu->func_bb.erase(cpu->cur_func);
+	job->unit->func = NULL;
+	job->unit->background = true;
+	job->unit->replaces = old;
+	old->replacement = job->unit;
+	cpu->cur_unit = NULL;
+	cpu->cur_func = NULL;
+
+	async_queue(cpu, job, cpu->mod);
+	cpu->mod = mod;
+}
+
+static void
+cpu_translate_function(cpu_t *cpu, const addr_list *region)
+{
+	bool counting = cpu->hot_threshold != 0 &&
+		!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB));
+	addr_list entries;
+	cpu_unit_t *unit;
+
+	if (async_enabled(cpu))
+		/* run unoptimized code until the compile thread is done */
+		unit = cpu_compile_tier(cpu, region, 0, NULL);
+	else
+		unit = cpu_compile_tier(cpu, region, counting ? 0 : 1, NULL);
+
+	/*
+	 * register the new entries: single stepping code can only be
+	 * entered at the PC it was translated for, everything else at
+	 * every basic block that has a dispatch case.
+	 */
+	if (region == NULL)
+		entries.push_back(cpu->f.get_pc(cpu, cpu->rf.grf));
+	else
+		cpu_unit_blocks(cpu, entries);
+	cpu_install_unit(cpu, unit, entries);
+
+	if (async_enabled(cpu) && !counting)
+		cpu_queue_tier(cpu, unit, 1, NULL);
+}
+
+/*
+ * Install the units the compile thread has finished in place of
+ * the ones they replace, which go. No translated code runs
+ * meanwhile, so the guest only ever sees one of the two.
+ */
+static void
+cpu_install_compiled(cpu_t *cpu)
+{
+	std::vector<async_job_t *> jobs;
+
+	async_take_compiled(cpu, jobs);
+	for (std::vector<async_job_t *>::const_iterator it = jobs.begin(); it != jobs.end(); it++) {
+		async_job_t *job = *it;
+		cpu_unit_t *unit = job->unit;
+		cpu_unit_t *old = unit->replaces;
+
+		/* a replacement goes with the unit it replaces */
+		assert(old != NULL);
+		unit->func = job->func;
+		unit->fp = job->fp;
+		unit->code_size = job->code_size;
+		cpu->code_size += job->code_size;
+		if (job->level >= 0)
+			optimize_account(cpu, job->level, job->opt_time, job->code_size);
+
+		cpu_install_unit(cpu, unit, job->entries);
+		unit->replaces = NULL;
+		old->replacement = NULL;
+		codecache_retire_unit(cpu, old);
+		delete job;
+	}
+}
+
+/*
+ * The tier 0 unit that returned has got hot: translate its
+ * region again, optimized for the paths it has taken, and let
+ * the new unit take over all of its entries and link slots
+ * before the old one goes. No translated code runs meanwhile,
+ * so the guest only ever sees one of the two. With background
+ * optimization, the old unit runs until the new one is ready.
+ */
+static void
+cpu_tier_up(cpu_t *cpu)
+{
+	cpu_unit_t *unit;
+
+	unit = cpu->hot_unit;
+	cpu->hot_unit = NULL;
+	/* its replacement may be on the way already */
+	if (unit != NULL && unit->replacement == NULL) {
+		LOG("unit %u is hot\n", unit->id);
+		cpu->tier_ups++;
+		addr_list region(unit->entries);
+		profile_map profile(unit->block_count);
+		if (async_enabled(cpu)) {
+			cpu_queue_tier(cpu, unit, 2, &profile);
+		} else {
+			addr_list entries;
+			cpu_unit_t *hot = cpu_compile_tier(cpu, &region, 2, &profile);
+			cpu_unit_blocks(cpu, entries);
+			cpu_install_unit(cpu, hot, entries);
+			codecache_retire_unit(cpu, unit);
+		}
+	}
 }
 
 /* forces ahead of time translation (e.g. for benchmarking the run) */
 void
 cpu_translate(cpu_t *cpu)
 {
-	/* on demand translation */
-	if (cpu->tags_dirty)
-		cpu_translate_function(cpu);
-
+	/* on demand translation; only cpu_tag() sets tags_dirty */
+	if (!cpu->tags_dirty)
+		return;
+
+	/* make room first, so the new code can't be evicted right away */
+	codecache_trim(cpu);
+	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB)) {
+		cpu_translate_function(cpu, NULL);
+	} else {
+		/* one unit per region, so compile time stays bounded */
+		region_list regions;
+		cpu_find_regions(cpu, regions);
+		for (region_list::const_iterator it = regions.begin(); it != regions.end(); it++)
+			cpu_translate_function(cpu, &*it);
+	}
 	cpu->tags_dirty = false;
 }
 
@@ -343,42 +585,49 @@ void breakpoint() {}
 int
 cpu_run(cpu_t *cpu, debug_function_t debug_function)
 {
-	addr_t pc = 0, orig_pc = 0;
-	uint32_t i;
+	addr_t pc = 0;
 	int ret;
-	bool success;
-	bool do_translate = true;
+	bool tagged = false;
 
-	/* try to find the entry in all functions */
 	while(true) {
-		if (do_translate) {
-			cpu_translate(cpu);
-			pc = cpu->f.get_pc(cpu, cpu->rf.grf);
-		}
-
-		orig_pc = pc;
-		success = false;
-		for (i = 0; i < cpu->functions; i++) {
-			fp_t FP = (fp_t)cpu->fp[i];
-			update_timing(cpu, TIMER_RUN, true);
-			breakpoint();
-			ret = FP(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
-			update_timing(cpu, TIMER_RUN, false);
-			pc = cpu->f.get_pc(cpu, cpu->rf.grf);
-			if (ret != JIT_RETURN_FUNCNOTFOUND)
-				return ret;
-			if (!is_inside_code_area(cpu, pc))
-				return ret;
-			if (pc != orig_pc) {
-				success = true;
-				break;
-			}
-		}
-		if (!success) {
+		if (cpu->hot_unit != NULL)
+			cpu_tier_up(cpu);
+		/* on demand translation */
+		cpu_translate(cpu);
+		/* optimized code from the compile thread */
+		cpu_install_compiled(cpu);
+		pc = cpu->f.get_pc(cpu, cpu->rf.grf);
+
+		/* find the code that can be entered at this PC */
+		fp_t FP = (fp_t)entry_lookup(cpu, pc);
+		if (FP == NULL) {
+			/*
+			 * unknown entry: tag and translate it, unless
+			 * that has already been tried and didn't help.
+			 * Single stepping may leave the code area.
+			 */
+			if (tagged || (!is_inside_code_area(cpu, pc) &&
+					!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))))
+				return JIT_RETURN_FUNCNOTFOUND;
 			LOG("{%" PRIx64 "}", pc);
 			cpu_tag(cpu, pc);
-			do_translate = true;
+			tagged = true;
+			continue;
 		}
+		tagged = false;
+
+		update_timing(cpu, TIMER_RUN, true);
+		breakpoint();
+		cpu->call_depth = 0;
+		cpu->link_depth = 0;
+		ret = FP(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
+		update_timing(cpu, TIMER_RUN, false);
+		/* the code wrote to translated code */
+		if (smc_pending(cpu))
+			smc_invalidate_pending(cpu);
+		/* a guest return out of the code entered here goes on, too */
+		if (ret != JIT_RETURN_FUNCNOTFOUND && ret != JIT_RETURN_GUESTRET)
+			return ret;
 	}
 }
 //printf("%d\n", __LINE__);
@@ -386,13 +635,11 @@ cpu_run(cpu_t *cpu, debug_function_t debug_function)
 void
 cpu_flush(cpu_t *cpu)
 {
-	cpu->exec_engine->freeMachineCodeForFunction(cpu->cur_func);
-	cpu->cur_func->eraseFromParent();
-
-	cpu->functions = 0;
+	codecache_flush(cpu);
 
-	// reset bb caching mapping
-	cpu->func_bb.clear();
+	/* everything gets translated again on demand, from the current code */
+	clear_all_tags(cpu, TAG_TRANSLATED);
+	clear_all_decoded(cpu);
 
 //	delete cpu->mod;
 //	cpu->mod = NULL;
@@ -405,5 +652,9 @@ cpu_print_statistics(cpu_t *cpu)
 	printf("fe  = %8" PRId64 "\n", cpu->timer_total[TIMER_FE]);
 	printf("be  = %8" PRId64 "\n", cpu->timer_total[TIMER_BE]);
 	printf("run = %8" PRId64 "\n", cpu->timer_total[TIMER_RUN]);
+	if (cpu->tier_ups != 0)
+		printf("hot = %8u units, traces = %u, loops = %u\n",
+			cpu->tier_ups, cpu->traces, cpu->loop_traces);
+	optimize_print_statistics(cpu);
 }
 //printf("%s:%d\n", __func__, __LINE__);
@@ -8,11 +8,15 @@
 #include <string.h>
 #include <stdint.h>
 #include <map>
+#include <vector>
 
 namespace llvm {
 class BasicBlock;
+class DataLayout;
 class ExecutionEngine;
 class Function;
+class IndirectBrInst;
+class JITEventListener;
 class Module;
 class PointerType;
 class StructType;
@@ -44,6 +48,11 @@ typedef uint64_t    (*fp_get_psr)(struct cpu *cpu, void *regs);
 typedef int         (*fp_get_reg)(struct cpu *cpu, void *regs, unsigned reg_no, uint64_t *value);
 typedef int         (*fp_get_fp_reg)(struct cpu *cpu, void *regs, unsigned reg_no, void *value);
 // @@@END_DEPRECATION
+// decoded instruction cache (optional)
+typedef void       *(*fp_decode_instr)(struct cpu *cpu, addr_t pc);
+typedef void        (*fp_free_decoded)(struct cpu *cpu, void *decoded);
+// dead flag analysis (optional)
+typedef void        (*fp_flags_instr)(struct cpu *cpu, addr_t pc, uint32_t *read, uint32_t *written);
 
 typedef struct {
 	fp_init init;
@@ -63,6 +72,12 @@ typedef struct {
 	fp_get_reg get_reg;
 	fp_get_fp_reg get_fp_reg;
 // @@@END_DEPRECATION
+	// decoded instruction cache, see get_decoded_instr()
+	fp_decode_instr decode_instr;
+	fp_free_decoded free_decoded;
+	// flags an instruction reads and writes, as masks of
+	// 1 << cpu_flags_layout_t.shift; see flag_is_live()
+	fp_flags_instr flags_instr;
 } arch_func_t;
 
 typedef enum {
@@ -176,6 +191,7 @@ typedef struct cpu_archinfo {
 	uint32_t vector_size;
 	uint32_t address_size;
 	uint32_t psr_size;
+	uint32_t instruction_align; // code is aligned to this many bytes (0: 1)
 
 	uint32_t min_page_size;
 	uint32_t max_page_size;
@@ -204,6 +220,54 @@ typedef struct cpu_archrf {
 
 typedef std::map<addr_t, BasicBlock *> bbaddr_map;
 typedef std::map<Function *, bbaddr_map> funcbb_map;
+typedef std::vector<addr_t> addr_list;
+typedef std::map<addr_t, void *> linkslot_map;
+
+typedef struct ibtc_site {
+	addr_t target[IBTC_WAYS]; // most recent first
+	addr_t cache_pc; // last target found in another unit
+	void *cache_fp;  // its entry, see ibtc_lookup()
+} ibtc_site_t;
+typedef std::map<addr_t, ibtc_site_t> ibtcsite_map;
+
+typedef struct shadow_entry {
+	addr_t pc;   // guest return address
+	void *unit;  // function that pushed it
+	void *block; // blockaddress of the return target in 'unit'
+	void **slot; // link slot of 'pc', for returns from other units
+} shadow_entry_t;
+
+typedef struct entry_table entry_table_t;
+typedef struct async_state async_state_t;
+typedef struct opt_pipeline opt_pipeline_t;
+typedef struct tag_page tag_page_t;
+typedef std::map<addr_t, tag_page_t *> tagpage_map;
+
+typedef struct addr_range {
+	addr_t start;
+	addr_t end; // exclusive
+} addr_range_t;
+typedef std::vector<addr_range_t> range_list;
+typedef std::map<addr_t, uint32_t> profile_map;
+typedef std::map<addr_t, uint32_t> flagmask_map;
+
+typedef struct cpu_unit {
+	uint32_t id;       // stable handle, reused once the unit is freed
+	Function *func;
+	void *fp;
+	size_t code_size;  // host code bytes, as reported by the JIT
+	addr_list entries; // guest PCs that enter this unit
+	range_list ranges; // guest code translated into this unit
+	uint8_t referenced; // set by the unit's code whenever it is entered
+	uint8_t tier;      // 0: unoptimized and counting, 1: optimized, 2: hot
+	uint32_t count;    // entries so far, counted in tier 0 only
+	profile_map block_count; // tier 0: executions per basic block
+	uint8_t leave;     // its replacement is ready: loops leave it
+	bool background;   // compiled by the compile thread, which owns 'func'
+	struct cpu_unit *replaces; // pending: the unit it is going to replace
+	struct cpu_unit *replacement; // the pending unit that replaces it
+} cpu_unit_t;
+typedef std::vector<cpu_unit_t *> unit_list;
 
 typedef struct cpu {
 	cpu_archinfo_t info;
@@ -222,19 +286,57 @@ typedef struct cpu {
 	uint32_t flags;
 	uint8_t code_digest[20];
 	FILE *file_entries;
-	tag_t *tag;
+	tagpage_map tag_pages; // see tag.cpp
+	addr_t tag_page_last_key;
+	tag_page_t *tag_page_last;
+	uint32_t tag_shift; // log2 of instruction_align
+	bool tags_initialized;
+	uint32_t tag_budget; // instructions per cpu_tag(), 0: no limit
 	bool tags_dirty;
 	Module *mod;
-	void *fp[1024];
-	Function *func[1024];
-	Function *cur_func;
-	uint32_t functions;
+	unit_list units; // code cache, indexed by unit id; NULL if free
+	std::vector<uint32_t> free_units; // ids of NULL slots in units
+	uint32_t unit_count;
+	size_t code_size;
+	size_t code_cache_limit; // 0: unlimited
+	uint32_t clock_hand; // next unit to consider for eviction
+	uint32_t hot_threshold; // entries before tier 0 code is recompiled, 0: off
+	cpu_unit_t *hot_unit; // tier 0 unit that just reached the threshold
+	uint32_t tier_ups; // hot units translated again so far
+	uint32_t traces; // formed in them, see trace.cpp
+	uint32_t loop_traces; // traces that branch back to their head
+	cpu_unit_t *cur_unit;
+	Function *cur_func; // cur_unit->func
+	JITEventListener *jit_listener;
+	uint32_t *smc_pages; // translated ranges per page of the code area
+	uint32_t smc_page_count;
+	addr_t smc_lo; // pending code write [smc_lo, smc_hi)
+	addr_t smc_hi;
+	bool smc_stores; // the current instruction stores to memory
+	entry_table_t *entry_table; // guest PC -> host entry
+	async_state_t *async; // compile thread, see async.cpp
+	std::vector<opt_pipeline_t *> pipelines; // indexed by level, see optimize.cpp
+	uint32_t opt_level;
+	linkslot_map link_slots; // guest PC -> host entry, for linked units
+	flagmask_map flags_live_out; // of the region being translated, see flags.cpp
+	ibtcsite_map ibtc_sites; // computed branch PC -> recent targets
+	shadow_entry_t shadow_stack[SHADOW_STACK_SIZE]; // return prediction
+	uint32_t shadow_top;
+	std::vector<BasicBlock *> shadow_ret_bbs; // pushed by cur_func
+	std::vector<IndirectBrInst *> shadow_sites; // returns in cur_func
 	ExecutionEngine *exec_engine;
 	uint8_t *RAM;
-	Value *ptr_PC;
+	Value *ptr_PC; // local in the unit, see pc.cpp
+	Value *in_ptr_PC; // in the register set
 	Value *ptr_RAM;
 	PointerType *type_pfunc_callout;
 	Value *ptr_func_debug;
+	Value *ptr_link_fp; // unit to continue in
+	Value *ptr_ibtc_site; // computed branch that missed, see ibtc.cpp
+	BasicBlock *bb_link; // tail calls *ptr_link_fp
+	BasicBlock *bb_guest_ret; // returns from a host call, see call.cpp
+	uint32_t call_depth; // host calls of translated code
+	uint32_t link_depth; // links since cpu_run() entered the code
 
 	Value *ptr_grf; // gpr register file
 	Value **ptr_gpr; // GPRs
@@ -252,6 +354,19 @@ typedef struct cpu {
 	Value *ptr_V;
 	Value *ptr_Z;
 	Value *ptr_C;
+	Value *ptr_P; // parity
+	/* lazy flags: derived from ptr_flags_result if set, see frontend.cpp */
+	Value *ptr_N_lazy;
+	Value *ptr_Z_lazy;
+	Value *ptr_P_lazy;
+	Value *ptr_flags_result;
+	/* C and V: derived from the last addition if set */
+	Value *ptr_C_lazy;
+	Value *ptr_V_lazy;
+	Value *ptr_flags_op; // its kind (width)
+	Value *ptr_flags_src1;
+	Value *ptr_flags_src2;
+	Value *ptr_flags_sum; // without wrap-around
 
 	uint64_t timer_total[TIMER_COUNT];
 	uint64_t timer_start[TIMER_COUNT];
@@ -263,7 +378,8 @@ enum {
 	JIT_RETURN_NOERR = 0,
 	JIT_RETURN_FUNCNOTFOUND,
 	JIT_RETURN_SINGLESTEP,
-	JIT_RETURN_TRAP
+	JIT_RETURN_TRAP,
+	JIT_RETURN_GUESTRET // internal: a guest return, see call.cpp
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -285,6 +401,29 @@ enum {
 // cache exists.
 #define CPU_CODEGEN_TAG_LIMIT (1<<2)
 
+// Detect writes to guest code that has been translated, and
+// translate it again. Stores get slightly slower; this is only
+// needed for guests that modify their code.
+#define CPU_CODEGEN_SMC (1<<3)
+
+// Optimize in a background thread: new code is translated without
+// optimizations first, and cpu_run() keeps running it until the
+// optimized code is ready. Ignored when single stepping or without
+// pthreads.
+#define CPU_CODEGEN_BACKGROUND (1<<4)
+
+// Translate guest calls to known subroutines into host calls,
+// and guest returns into host returns, so every subroutine runs
+// in a host stack frame of its own; good for deeply recursive
+// code. Only for frontends without a register decoding hook.
+#define CPU_CODEGEN_CALLS (1<<5)
+
+// Optimization levels for cpu_set_opt_level(), when optimizing
+// is on; cpu_add_opt_pipeline() adds more.
+#define CPU_OPT_FAST     0 // quick cleanup, for short running guests
+#define CPU_OPT_BALANCED 1
+#define CPU_OPT_MAX      2 // for long running guests; also for hot code
+
 //////////////////////////////////////////////////////////////////////
 // debug flags
 //////////////////////////////////////////////////////////////////////
@@ -319,6 +458,23 @@ enum {
  */
 typedef void (*debug_function_t)(cpu_t*);
 
+typedef struct cpu_code_cache_stats {
+	uint32_t units;     // translation units in the cache
+	uint32_t capacity;  // unit slots allocated so far
+	uint32_t entries;   // guest addresses that can be entered
+	uint64_t code_size; // bytes of host code
+	uint32_t tier_ups;  // hot units translated again
+	uint32_t traces;    // superblocks formed in them
+	uint32_t loop_traces; // of which are loops
+} cpu_code_cache_stats_t;
+
+typedef struct cpu_opt_stats {
+	const char *name;   // of the pipeline
+	uint32_t units;     // translation units it optimized
+	uint64_t opt_time;  // spent in its passes, in abs_time() units
+	uint64_t code_size; // bytes of host code these units became
+} cpu_opt_stats_t;
+
 //////////////////////////////////////////////////////////////////////
 
 API_FUNC cpu_t *cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags);
@@ -326,11 +482,19 @@ API_FUNC void cpu_free(cpu_t *cpu);
 API_FUNC void cpu_set_flags_codegen(cpu_t *cpu, uint32_t f);
 API_FUNC void cpu_set_flags_hint(cpu_t *cpu, uint32_t f);
 API_FUNC void cpu_set_flags_debug(cpu_t *cpu, uint32_t f);
-API_FUNC void cpu_tag(cpu_t *cpu, addr_t pc);
+API_FUNC uint32_t cpu_tag(cpu_t *cpu, addr_t pc);
+API_FUNC void cpu_set_tag_budget(cpu_t *cpu, uint32_t instructions);
 API_FUNC int cpu_run(cpu_t *cpu, debug_function_t debug_function);
 API_FUNC void cpu_translate(cpu_t *cpu);
 API_FUNC void cpu_set_ram(cpu_t *cpu, uint8_t *RAM);
 API_FUNC void cpu_flush(cpu_t *cpu);
+API_FUNC void cpu_invalidate_range(cpu_t *cpu, addr_t start, addr_t end);
+API_FUNC void cpu_get_code_cache_stats(cpu_t *cpu, cpu_code_cache_stats_t *stats);
+API_FUNC void cpu_set_code_cache_limit(cpu_t *cpu, size_t limit);
+API_FUNC void cpu_set_hot_threshold(cpu_t *cpu, uint32_t entries);
+API_FUNC int cpu_set_opt_level(cpu_t *cpu, uint32_t level);
+API_FUNC int cpu_add_opt_pipeline(cpu_t *cpu, const char *name, const char *passes);
+API_FUNC bool cpu_get_opt_stats(cpu_t *cpu, uint32_t level, cpu_opt_stats_t *stats);
 API_FUNC void cpu_print_statistics(cpu_t *cpu);
 
 /* runs the interactive debugger */
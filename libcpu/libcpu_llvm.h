@@ -2,6 +2,7 @@
 #define _LIBCPU_LLVM_H_
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/LLVMContext.h"
 
@@ -15,6 +16,10 @@
 #define getNamedStructType(x, ...) (StructType::create(_CTX(), x, name,    \
 					       #__VA_ARGS__))
 
+/* host data the generated code refers to, see frontend.cpp */
+Constant *get_host_address(cpu_t *cpu, void *p);
+Constant *get_host_pointer(cpu_t *cpu, void *p, Type *type);
+
 static inline fltSemantics const *getFltSemantics(unsigned bits)
 {
 	switch(bits) {
@@ -0,0 +1,109 @@
+/*
+ * libcpu: link.cpp
+ *
+ * Direct linking of translation units. A branch to a basic block
+ * that lives in another unit loads the entry of that unit from a
+ * link slot and tail calls it, instead of returning to cpu_run().
+ * The slot is filled in as soon as the target gets translated.
+ * After LIMIT_LINK_DEPTH links in a row, the unit returns to
+ * cpu_run() instead, in case the tail calls weren't jumps.
+ */
+
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "entry.h"
+#include "link.h"
+#include "ibtc.h"
+
+/*
+ * Get the link slot for a guest address. Slots live in a std::map,
+ * so their address is stable and can be baked into the code.
+ */
+void **
+link_get_slot(cpu_t *cpu, addr_t pc)
+{
+	linkslot_map::iterator i = cpu->link_slots.find(pc);
+	if (i == cpu->link_slots.end())
+		i = cpu->link_slots.insert(std::make_pair(pc, entry_lookup(cpu, pc))).first;
+	return &i->second;
+}
+
+/* the code at 'pc' can now be entered through 'fp' (or NULL: no more) */
+void
+link_update(cpu_t *cpu, addr_t pc, void *fp)
+{
+	linkslot_map::iterator i = cpu->link_slots.find(pc);
+	if (i != cpu->link_slots.end())
+		i->second = fp;
+}
+
+/* forget all slots; only valid once no code refers to them anymore */
+void
+link_clear(cpu_t *cpu)
+{
+	cpu->link_slots.clear();
+}
+
+/*
+ * Emit the linking code for leaving the current unit towards 'pc':
+ * if the target is translated, continue there through the unit's
+ * "link" block, otherwise return to the caller.
+ */
+void
+emit_link(cpu_t *cpu, BasicBlock *bb, addr_t pc, BasicBlock *bb_ret)
+{
+	PointerType *type_pfunc = cpu->cur_func->getType();
+	Value *ptr_slot = get_host_pointer(cpu, link_get_slot(cpu, pc), type_pfunc);
+
+	Value *fp = new LoadInst(ptr_slot, "", false, bb);
+	new StoreInst(fp, cpu->ptr_link_fp, false, bb);
+	Value *linked = new ICmpInst(*bb, ICmpInst::ICMP_NE, fp,
+		ConstantPointerNull::get(type_pfunc), "");
+	BranchInst::Create(cpu->bb_link, bb_ret, linked, bb);
+}
+
+/*
+ * Create the basic block that continues at the PC in the register
+ * file when it's not in this unit: look the PC up in the entry
+ * table and link there, or return to the caller if it's unknown.
+ * The lookup fills in the cache of the computed branch that got
+ * here, if any, see ibtc.cpp.
+ */
+BasicBlock *
+create_lookup_basicblock(cpu_t *cpu, BasicBlock *bb_ret)
+{
+	IntegerType *intptr_type = cpu->exec_engine->getDataLayout()->getIntPtrType(_CTX());
+	PointerType *type_pfunc = cpu->cur_func->getType();
+	BasicBlock *bb = BasicBlock::Create(_CTX(), "lookup", cpu->cur_func, 0);
+
+	// - void *ibtc_lookup(cpu_t *cpu, ibtc_site_t *site, addr_t pc)
+	std::vector<Type*> type_lookup_args;
+	type_lookup_args.push_back(intptr_type);
+	type_lookup_args.push_back(intptr_type);
+	type_lookup_args.push_back(getIntegerType(64));
+	FunctionType *type_lookup = FunctionType::get(type_pfunc, type_lookup_args, false);
+	Constant *v_lookup = get_host_pointer(cpu, (void *)&ibtc_lookup, type_lookup);
+
+	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb);
+	std::vector<Value*> args;
+	args.push_back(get_host_address(cpu, cpu));
+	args.push_back(new LoadInst(cpu->ptr_ibtc_site, "", false, bb));
+	args.push_back(CastInst::CreateZExtOrBitCast(v_pc, getIntegerType(64), "", bb));
+	Value *fp = CallInst::Create(v_lookup, args, "", bb);
+
+	new StoreInst(fp, cpu->ptr_link_fp, false, bb);
+	Value *found = new ICmpInst(*bb, ICmpInst::ICMP_NE, fp,
+		ConstantPointerNull::get(type_pfunc), "");
+	BranchInst::Create(cpu->bb_link, bb_ret, found, bb);
+
+	return bb;
+}
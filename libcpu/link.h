@@ -0,0 +1,5 @@
+void **link_get_slot(cpu_t *cpu, addr_t pc);
+void link_update(cpu_t *cpu, addr_t pc, void *fp);
+void link_clear(cpu_t *cpu);
+void emit_link(cpu_t *cpu, BasicBlock *bb, addr_t pc, BasicBlock *bb_ret);
+BasicBlock *create_lookup_basicblock(cpu_t *cpu, BasicBlock *bb_ret);
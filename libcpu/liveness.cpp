@@ -0,0 +1,263 @@
+/*
+ * libcpu: liveness.cpp
+ *
+ * Guest register liveness per unit. emit_decode_reg() copies every
+ * guest register into a local variable on entry, and every exit
+ * copies them all back with spill_reg_state(). Once a unit has
+ * been translated, this pass drops the copies back of registers
+ * that can't have been written on any path to them, and the copies
+ * in of registers nothing reads any more. A unit that only touches
+ * a few registers then only loads and stores these, even before
+ * (or without) optimization.
+ */
+#include <map>
+#include <vector>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CFG.h"
+
+#include "libcpu.h"
+#include "liveness.h"
+
+#ifdef OPT_LOCAL_REGISTERS
+
+typedef struct reg_slot {
+	Value *local; // the copy of the register in the unit
+	Value *rf;    // the register in the register file
+	bool opaque;  // used in ways we can't follow
+	bool read;
+	uint32_t spills;
+} reg_slot_t;
+
+typedef std::vector<bool> reg_set;
+
+enum {
+	REG_NONE,
+	REG_READ,
+	REG_WRITE,
+	REG_COPY_IN, // local = rf
+	REG_SPILL    // rf = local
+};
+
+typedef struct reg_liveness {
+	std::vector<reg_slot_t> slots;
+	std::map<Value *, uint32_t> local_index;
+	std::map<Value *, uint32_t> rf_index;
+	std::map<BasicBlock *, reg_set> dirty_out;
+} reg_liveness_t;
+
+/* the FPRs are two words each if the host has no such float type */
+static inline uint32_t
+fp_reg_words(cpu_t *cpu)
+{
+	uint32_t width = cpu->info.register_size[CPU_REG_FPR];
+
+	if ((width == 80 && (cpu->flags & CPU_FLAG_FP80) == 0) ||
+		(width == 128 && (cpu->flags & CPU_FLAG_FP128) == 0))
+		return 2;
+	return 1;
+}
+
+static void
+liveness_add(reg_liveness_t &lv, uint32_t count, Value **in_ptr_r, Value **ptr_r)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		reg_slot_t slot;
+
+		if (ptr_r[i] == NULL || in_ptr_r[i] == NULL)
+			continue;
+		slot.local = ptr_r[i];
+		slot.rf = in_ptr_r[i];
+		slot.read = false;
+		slot.spills = 0;
+
+		/* anything but loading and storing it might change it */
+		slot.opaque = false;
+		for (Value::use_iterator u = slot.local->use_begin(); u != slot.local->use_end(); u++) {
+			if (isa<LoadInst>(*u))
+				continue;
+			StoreInst *store = dyn_cast<StoreInst>(*u);
+			if (store == NULL || store->getValueOperand() == slot.local)
+				slot.opaque = true;
+		}
+
+		lv.local_index[slot.local] = lv.slots.size();
+		lv.rf_index[slot.rf] = lv.slots.size();
+		lv.slots.push_back(slot);
+	}
+}
+
+static int
+liveness_classify(reg_liveness_t &lv, Instruction *inst, uint32_t *index)
+{
+	std::map<Value *, uint32_t>::const_iterator it;
+
+	if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+		it = lv.local_index.find(load->getPointerOperand());
+		if (it == lv.local_index.end())
+			return REG_NONE;
+		*index = it->second;
+		/* the load of a spill belongs to the spill */
+		if (load->hasOneUse()) {
+			StoreInst *store = dyn_cast<StoreInst>(*load->use_begin());
+			if (store != NULL && store->getPointerOperand() == lv.slots[it->second].rf)
+				return REG_NONE;
+		}
+		return REG_READ;
+	}
+
+	if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+		LoadInst *value = dyn_cast<LoadInst>(store->getValueOperand());
+
+		it = lv.local_index.find(store->getPointerOperand());
+		if (it != lv.local_index.end()) {
+			*index = it->second;
+			if (value != NULL && value->getPointerOperand() == lv.slots[it->second].rf)
+				return REG_COPY_IN;
+			return REG_WRITE;
+		}
+		it = lv.rf_index.find(store->getPointerOperand());
+		if (it != lv.rf_index.end() && value != NULL &&
+				value->getPointerOperand() == lv.slots[it->second].local) {
+			*index = it->second;
+			return REG_SPILL;
+		}
+	}
+
+	return REG_NONE;
+}
+
+/* registers that may be dirty when 'bb' is entered */
+static void
+liveness_dirty_in(reg_liveness_t &lv, BasicBlock *bb, reg_set &dirty)
+{
+	dirty.assign(lv.slots.size(), false);
+
+	for (pred_iterator p = pred_begin(bb); p != pred_end(bb); p++) {
+		std::map<BasicBlock *, reg_set>::const_iterator it = lv.dirty_out.find(*p);
+		if (it == lv.dirty_out.end())
+			continue;
+		for (size_t i = 0; i < lv.slots.size(); i++)
+			if (it->second[i])
+				dirty[i] = true;
+	}
+}
+
+/*
+ * Walk 'bb' from 'dirty' on; a write makes a register dirty, a copy
+ * in clean again. Collects the spills of clean registers and all
+ * copies in, if asked to. Returns whether the set at the end of the
+ * block has changed.
+ */
+static bool
+liveness_transfer(reg_liveness_t &lv, BasicBlock *bb, reg_set &dirty,
+	std::vector<StoreInst *> *dead_spills, std::vector<StoreInst *> *copy_ins)
+{
+	for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); inst++) {
+		uint32_t i;
+
+		switch (liveness_classify(lv, inst, &i)) {
+			case REG_READ:
+				lv.slots[i].read = true;
+				break;
+			case REG_WRITE:
+				dirty[i] = true;
+				break;
+			case REG_COPY_IN:
+				dirty[i] = false;
+				if (copy_ins != NULL)
+					copy_ins->push_back(cast<StoreInst>(inst));
+				break;
+			case REG_SPILL:
+				if (dead_spills != NULL && !dirty[i] && !lv.slots[i].opaque)
+					dead_spills->push_back(cast<StoreInst>(inst));
+				else
+					lv.slots[i].spills++;
+				break;
+		}
+	}
+
+	reg_set &out = lv.dirty_out[bb];
+	if (out == dirty)
+		return false;
+	out = dirty;
+	return true;
+}
+
+static void
+erase_store(StoreInst *store)
+{
+	Instruction *value = dyn_cast<Instruction>(store->getValueOperand());
+
+	store->eraseFromParent();
+	if (value != NULL && value->use_empty())
+		value->eraseFromParent();
+}
+
+/*
+ * Drop the register copies 'f' doesn't need; must be called while
+ * 'f' is still the current function, i.e. before the next one gets
+ * created.
+ */
+void
+liveness_prune_regs(cpu_t *cpu, Function *f)
+{
+	reg_liveness_t lv;
+	std::vector<StoreInst *> dead_spills, copy_ins;
+	reg_set dirty;
+	bool changed;
+
+	liveness_add(lv, cpu->info.register_count[CPU_REG_GPR], cpu->in_ptr_gpr, cpu->ptr_gpr);
+	liveness_add(lv, cpu->info.register_count[CPU_REG_XR], cpu->in_ptr_xr, cpu->ptr_xr);
+	liveness_add(lv, cpu->info.register_count[CPU_REG_FPR] * fp_reg_words(cpu),
+		cpu->in_ptr_fpr, cpu->ptr_fpr);
+	if (lv.slots.empty())
+		return;
+
+	/* may be dirty: iterate to the smallest fixed point */
+	do {
+		changed = false;
+		for (Function::iterator bb = f->begin(); bb != f->end(); bb++) {
+			liveness_dirty_in(lv, bb, dirty);
+			changed |= liveness_transfer(lv, bb, dirty, NULL, NULL);
+		}
+	} while (changed);
+
+	for (size_t i = 0; i < lv.slots.size(); i++)
+		lv.slots[i].spills = 0;
+	for (Function::iterator bb = f->begin(); bb != f->end(); bb++) {
+		liveness_dirty_in(lv, bb, dirty);
+		liveness_transfer(lv, bb, dirty, &dead_spills, &copy_ins);
+	}
+
+	/* the register file holds the value already */
+	for (size_t i = 0; i < dead_spills.size(); i++)
+		erase_store(dead_spills[i]);
+
+	/* nobody needs the value any more */
+	for (size_t i = 0; i < copy_ins.size(); i++) {
+		reg_slot_t &slot = lv.slots[lv.local_index[copy_ins[i]->getPointerOperand()]];
+		if (!slot.opaque && !slot.read && slot.spills == 0)
+			erase_store(copy_ins[i]);
+	}
+
+	for (size_t i = 0; i < lv.slots.size(); i++) {
+		Instruction *local = dyn_cast<Instruction>(lv.slots[i].local);
+		Instruction *rf = dyn_cast<Instruction>(lv.slots[i].rf);
+		if (local != NULL && local->use_empty())
+			local->eraseFromParent();
+		if (rf != NULL && rf->use_empty())
+			rf->eraseFromParent();
+	}
+}
+
+#else
+
+void
+liveness_prune_regs(cpu_t *cpu, Function *f)
+{
+}
+
+#endif /* OPT_LOCAL_REGISTERS */
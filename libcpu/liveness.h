@@ -0,0 +1 @@
+void liveness_prune_regs(cpu_t *cpu, Function *f);
@@ -1,26 +1,220 @@
 /*
  * libcpu: optimize.cpp
  *
- * Tell LLVM to run optimizers over the IR.
+ * Tell LLVM to run optimizers over the IR. The passes run are
+ * picked by the optimization level, each of which names a
+ * pipeline: a list of LLVM pass names. Three pipelines are
+ * built in, clients can add their own.
  */
 
+#include <assert.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
-#include "llvm/Transforms/Scalar.h"
 #include "llvm/IR/Module.h"
 #include "llvm/PassManager.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/PassSupport.h"
+#include "llvm/InitializePasses.h"
 #include "llvm/IR/DataLayout.h"
 
 #include "libcpu.h"
+#include "timings.h"
+#include "optimize.h"
+
+struct opt_pipeline {
+	std::string name;
+	std::vector<const PassInfo *> passes;
+	uint32_t units;     // functions optimized
+	uint64_t opt_time;  // time spent in the passes, abs_time() units
+	uint64_t code_size; // host code they became
+};
+
+/* the order matches CPU_OPT_FAST, CPU_OPT_BALANCED, CPU_OPT_MAX */
+static const char *builtin_pipelines[][2] = {
+	{ "fast",
+	  "mem2reg,instcombine,constprop,dce" },
+	{ "balanced",
+	  "sroa,early-cse,instcombine,reassociate,gvn,simplifycfg,dce" },
+	/* loop passes after a first cleanup of dispatch and flag code */
+	{ "max",
+	  "tbaa,basicaa,sroa,early-cse,instcombine,jump-threading,simplifycfg,"
+	  "reassociate,sccp,loop-rotate,licm,indvars,loop-unroll,gvn,"
+	  "instcombine,jump-threading,dse,adce,simplifycfg" },
+};
+
+static void
+register_passes()
+{
+	static bool done = false;
+
+	if (done)
+		return;
+
+	PassRegistry &registry = *PassRegistry::getPassRegistry();
+	initializeCore(registry);
+	initializeScalarOpts(registry);
+	initializeIPO(registry);
+	initializeAnalysis(registry);
+	initializeIPA(registry);
+	initializeTransformUtils(registry);
+	initializeInstCombine(registry);
+	done = true;
+}
+
+/* parse a comma separated list of pass names; NULL if one is unknown */
+static opt_pipeline_t *
+pipeline_create(const char *name, const char *passes)
+{
+	opt_pipeline_t *pipeline = new opt_pipeline_t;
+	std::string list(passes);
+	size_t start = 0;
+
+	register_passes();
+
+	while (start < list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+
+		std::string pass = list.substr(start, end - start);
+		const PassInfo *info = PassRegistry::getPassRegistry()->getPassInfo(pass);
+		if (info == NULL || info->getNormalCtor() == NULL) {
+			LOG("unknown LLVM pass '%s' in pipeline '%s'\n", pass.c_str(), name);
+			delete pipeline;
+			return NULL;
+		}
+		pipeline->passes.push_back(info);
+		start = end + 1;
+	}
+
+	pipeline->name = name;
+	pipeline->units = 0;
+	pipeline->opt_time = 0;
+	pipeline->code_size = 0;
+	return pipeline;
+}
 
 void
-optimize(cpu_t *cpu)
+optimize_init(cpu_t *cpu)
 {
-	FunctionPassManager pm = FunctionPassManager(cpu->mod);
+	cpu->opt_level = CPU_OPT_FAST;
+	for (size_t i = 0; i < sizeof(builtin_pipelines) / sizeof(builtin_pipelines[0]); i++) {
+		opt_pipeline_t *pipeline = pipeline_create(builtin_pipelines[i][0],
+			builtin_pipelines[i][1]);
+		assert(pipeline != NULL);
+		cpu->pipelines.push_back(pipeline);
+	}
+}
 
-	pm.add(createPromoteMemoryToRegisterPass());
-	pm.add(createInstructionCombiningPass());
-	pm.add(createConstantPropagationPass());
-	pm.add(createDeadCodeEliminationPass());
-	pm.run(*cpu->cur_func);
+void
+optimize_done(cpu_t *cpu)
+{
+	for (size_t i = 0; i < cpu->pipelines.size(); i++)
+		delete cpu->pipelines[i];
+	cpu->pipelines.clear();
 }
 
+/*
+ * Run the passes of 'pipeline' over 'func'; returns the time they
+ * took. Touches nothing but 'func', so the compile thread can run
+ * it on a function of its own.
+ */
+uint64_t
+optimize_function(opt_pipeline_t *pipeline, Function *func, const DataLayout *layout)
+{
+	FunctionPassManager pm = FunctionPassManager(func->getParent());
+	uint64_t t = abs_time();
+
+	pm.add(new DataLayout(*layout));
+	for (size_t i = 0; i < pipeline->passes.size(); i++)
+		pm.add(pipeline->passes[i]->createPass());
+
+	pm.doInitialization();
+	pm.run(*func);
+	pm.doFinalization();
+
+	return abs_time() - t;
+}
+
+opt_pipeline_t *
+optimize_pipeline(cpu_t *cpu, uint32_t level)
+{
+	return cpu->pipelines[level];
+}
+
+/* optimize the current function; returns the time it took */
+uint64_t
+optimize(cpu_t *cpu, uint32_t level)
+{
+	return optimize_function(cpu->pipelines[level], cpu->cur_func,
+		cpu->exec_engine->getDataLayout());
+}
+
+/* a function optimized at 'level' has been emitted */
+void
+optimize_account(cpu_t *cpu, uint32_t level, uint64_t opt_time, size_t code_size)
+{
+	opt_pipeline_t *pipeline = cpu->pipelines[level];
+
+	pipeline->units++;
+	pipeline->opt_time += opt_time;
+	pipeline->code_size += code_size;
+}
+
+/* returns -1 if there is no such level */
+int
+cpu_set_opt_level(cpu_t *cpu, uint32_t level)
+{
+	if (level >= cpu->pipelines.size())
+		return -1;
+	cpu->opt_level = level;
+	return 0;
+}
+
+/*
+ * Add a pipeline of LLVM passes, given by their names as for
+ * 'opt' (e.g. "mem2reg,instcombine,gvn"), which are run in that
+ * order. Returns the optimization level that selects it, or -1
+ * if a pass is unknown.
+ */
+int
+cpu_add_opt_pipeline(cpu_t *cpu, const char *name, const char *passes)
+{
+	opt_pipeline_t *pipeline = pipeline_create(name, passes);
+
+	if (pipeline == NULL)
+		return -1;
+	cpu->pipelines.push_back(pipeline);
+	return cpu->pipelines.size() - 1;
+}
+
+/* returns false if there is no such level */
+bool
+cpu_get_opt_stats(cpu_t *cpu, uint32_t level, cpu_opt_stats_t *stats)
+{
+	if (level >= cpu->pipelines.size())
+		return false;
+
+	opt_pipeline_t *pipeline = cpu->pipelines[level];
+	stats->name = pipeline->name.c_str();
+	stats->units = pipeline->units;
+	stats->opt_time = pipeline->opt_time;
+	stats->code_size = pipeline->code_size;
+	return true;
+}
+
+void
+optimize_print_statistics(cpu_t *cpu)
+{
+	for (size_t i = 0; i < cpu->pipelines.size(); i++) {
+		opt_pipeline_t *pipeline = cpu->pipelines[i];
+		if (pipeline->units == 0)
+			continue;
+		printf("opt %-10s units = %u, time = %" PRIu64 ", code = %" PRIu64 "\n",
+			pipeline->name.c_str(), pipeline->units,
+			pipeline->opt_time, pipeline->code_size);
+	}
+}
@@ -1 +1,7 @@
-void optimize(cpu_t *cpu);
+void optimize_init(cpu_t *cpu);
+void optimize_done(cpu_t *cpu);
+uint64_t optimize_function(opt_pipeline_t *pipeline, Function *func, const DataLayout *layout);
+opt_pipeline_t *optimize_pipeline(cpu_t *cpu, uint32_t level);
+uint64_t optimize(cpu_t *cpu, uint32_t level);
+void optimize_account(cpu_t *cpu, uint32_t level, uint64_t opt_time, size_t code_size);
+void optimize_print_statistics(cpu_t *cpu);
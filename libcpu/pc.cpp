@@ -0,0 +1,82 @@
+/*
+ * libcpu: pc.cpp
+ *
+ * The guest PC inside a unit. emit_decode_reg() makes cpu->ptr_PC a
+ * local variable, loaded from the register set on entry, so branches
+ * and LET_PC only store to the local and the optimizer can keep the
+ * PC in a host register. Once a unit has been translated, this pass
+ * writes the local back to the register set wherever somebody else
+ * may look at it: before every return (exits, traps, single step)
+ * and before every call of host code (debug callouts, entry lookups,
+ * called units), and loads it again after such a call, which may
+ * have changed it.
+ *
+ * Where the PC is one of the general purpose registers (r15 on ARM),
+ * it is addressed through jitmain's grf argument, so the noalias
+ * attribute and the TBAA tags of grf cover it, see alias.cpp.
+ */
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "pc.h"
+
+/*
+ * Whether the client's PC lies inside its general purpose register
+ * set, and at which byte offset; jitmain's grf argument must be
+ * there already.
+ */
+bool
+pc_in_grf(cpu_t *cpu, uintptr_t *offset)
+{
+	Type *type = cast<PointerType>(cpu->ptr_grf->getType())->getElementType();
+	uintptr_t size = cpu->exec_engine->getDataLayout()->getTypeAllocSize(type);
+	uintptr_t pc = (uintptr_t)cpu->rf.pc;
+	uintptr_t grf = (uintptr_t)cpu->rf.grf;
+
+	if (pc < grf || pc >= grf + size)
+		return false;
+	*offset = pc - grf;
+	return true;
+}
+
+static void
+pc_store_before(cpu_t *cpu, Instruction *inst)
+{
+	Value *v = new LoadInst(cpu->ptr_PC, "", false, inst);
+	new StoreInst(v, cpu->in_ptr_PC, false, inst);
+}
+
+static void
+pc_load_before(cpu_t *cpu, Instruction *inst)
+{
+	Value *v = new LoadInst(cpu->in_ptr_PC, "", false, inst);
+	new StoreInst(v, cpu->ptr_PC, false, inst);
+}
+
+void
+pc_write_back(cpu_t *cpu, Function *f)
+{
+	for (Function::iterator bb = f->begin(); bb != f->end(); bb++) {
+		for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); inst++) {
+			if (isa<ReturnInst>(inst)) {
+				/* a (tail) call right before has it written already */
+				if (inst != bb->begin() && isa<CallInst>(llvm::prior(inst)) &&
+						!isa<IntrinsicInst>(llvm::prior(inst)))
+					continue;
+				pc_store_before(cpu, inst);
+			} else if (isa<CallInst>(inst) && !isa<IntrinsicInst>(inst)) {
+				pc_store_before(cpu, inst);
+				BasicBlock::iterator next = llvm::next(inst);
+				if (!isa<ReturnInst>(next))
+					pc_load_before(cpu, next);
+			}
+		}
+	}
+}
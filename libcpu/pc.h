@@ -0,0 +1,2 @@
+bool pc_in_grf(cpu_t *cpu, uintptr_t *offset);
+void pc_write_back(cpu_t *cpu, Function *f);
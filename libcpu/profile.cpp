@@ -0,0 +1,147 @@
+/*
+ * libcpu: profile.cpp
+ *
+ * Block execution counts of tier 0 units. Tier 0 code counts how
+ * often each of its basic blocks runs; when the unit gets hot and
+ * is translated again, the counts become branch weights, so the
+ * optimizer and the code generator's block placement favour the
+ * paths the guest actually takes.
+ *
+ * A loop that never leaves its unit enters it only once, so the
+ * heads of loops also make the unit hot when their count reaches
+ * the threshold: they leave the unit right there, and cpu_run()
+ * enters the new code at the head. With background optimization,
+ * they also leave once the unit's replacement is ready.
+ */
+#include <set>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "tag.h"
+#include "basicblock.h"
+#include "codecache.h"
+#include "async.h"
+#include "profile.h"
+
+/*
+ * The blocks of 'region' that a branch in it goes back to, i.e.
+ * from the same or a higher address. Every loop inside the unit
+ * has at least one of them.
+ */
+void
+profile_find_loop_heads(cpu_t *cpu, const addr_list &region, std::set<addr_t> &heads)
+{
+	std::set<addr_t> blocks(region.begin(), region.end());
+
+	for (addr_list::const_iterator it = region.begin(); it != region.end(); it++) {
+		addr_t pc = *it;
+		for (;;) {
+			tag_t tag, dummy;
+			addr_t new_pc, next_pc;
+
+			tag = get_tag(cpu, pc);
+			tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+			if ((tag & TAG_BRANCH) && new_pc <= pc && blocks.count(new_pc))
+				heads.insert(new_pc);
+			if (!(tag & TAG_CONTINUE))
+				break;
+			pc = next_pc;
+			if (!is_code(cpu, pc) || is_start_of_basicblock(cpu, pc))
+				break;
+		}
+	}
+}
+
+/*
+ * count the executions of the block at 'pc' in 'bb'; the counts
+ * live in a std::map of the current unit, so their address is
+ * stable. The head of a loop also checks the hot threshold, and
+ * whether the unit is to be left for its replacement.
+ * Returns the block to continue in.
+ */
+BasicBlock *
+profile_emit_block_count(cpu_t *cpu, addr_t pc, BasicBlock *bb, bool loop_head,
+	BasicBlock *bb_ret)
+{
+	uint32_t *count = &cpu->cur_unit->block_count[pc];
+	Value *ptr_count = get_host_pointer(cpu, count, getIntegerType(32));
+
+	*count = 0;
+	Value *v = BinaryOperator::Create(Instruction::Add,
+		new LoadInst(ptr_count, "", false, bb),
+		ConstantInt::get(getIntegerType(32), 1), "", bb);
+	new StoreInst(v, ptr_count, false, bb);
+
+	if (!loop_head)
+		return bb;
+
+	Value *is_hot = NULL;
+	if (cpu->hot_threshold != 0)
+		is_hot = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v,
+			ConstantInt::get(getIntegerType(32), cpu->hot_threshold), "");
+	if (async_enabled(cpu)) {
+		/* set by the compile thread */
+		Value *ptr_leave = get_host_pointer(cpu, &cpu->cur_unit->leave, getIntegerType(8));
+		Value *leave = new ICmpInst(*bb, ICmpInst::ICMP_NE,
+			new LoadInst(ptr_leave, "", true, bb),
+			ConstantInt::get(getIntegerType(8), 0), "");
+		is_hot = is_hot == NULL ? leave :
+			BinaryOperator::Create(Instruction::Or, is_hot, leave, "", bb);
+	}
+	if (is_hot == NULL)
+		return bb;
+
+	BasicBlock *bb_hot = BasicBlock::Create(_CTX(), "hot", cpu->cur_func, 0);
+	BasicBlock *bb_cont = BasicBlock::Create(_CTX(), "counted", cpu->cur_func, 0);
+	BranchInst::Create(bb_hot, bb_cont, is_hot, bb);
+
+	/* the new code continues here */
+	emit_store_pc(cpu, bb_hot, pc);
+	codecache_emit_hot_exit(cpu, bb_hot, bb_ret);
+	return bb_cont;
+}
+
+/*
+ * Weight the conditional branches of 'f' between two guest basic
+ * blocks by how often these blocks ran. The count of a block is
+ * used as the count of the edge into it, which is exact unless
+ * the block has other predecessors.
+ */
+void
+profile_apply(cpu_t *cpu, Function *f, const profile_map &counts)
+{
+	std::map<const BasicBlock *, uint32_t> weight;
+	MDBuilder mdb(_CTX());
+
+	bbaddr_map &bb_addr = cpu->func_bb[f];
+	for (bbaddr_map::const_iterator it = bb_addr.begin(); it != bb_addr.end(); it++) {
+		profile_map::const_iterator c = counts.find(it->first);
+		if (c != counts.end())
+			weight[it->second] = c->second;
+	}
+
+	for (Function::iterator bb = f->begin(); bb != f->end(); bb++) {
+		BranchInst *br = dyn_cast<BranchInst>(bb->getTerminator());
+		if (br == NULL || !br->isConditional())
+			continue;
+
+		std::map<const BasicBlock *, uint32_t>::const_iterator w0, w1;
+		w0 = weight.find(br->getSuccessor(0));
+		w1 = weight.find(br->getSuccessor(1));
+		if (w0 == weight.end() || w1 == weight.end())
+			continue;
+
+		/* never claim a path is impossible, it only hasn't run yet */
+		br->setMetadata(LLVMContext::MD_prof,
+			mdb.createBranchWeights(w0->second + 1, w1->second + 1));
+	}
+}
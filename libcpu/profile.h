@@ -0,0 +1,3 @@
+void profile_find_loop_heads(cpu_t *cpu, const addr_list &region, std::set<addr_t> &heads);
+BasicBlock *profile_emit_block_count(cpu_t *cpu, addr_t pc, BasicBlock *bb, bool loop_head, BasicBlock *bb_ret);
+void profile_apply(cpu_t *cpu, Function *f, const profile_map &counts);
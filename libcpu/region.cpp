@@ -0,0 +1,124 @@
+/*
+ * libcpu: region.cpp
+ *
+ * Split the tagged but untranslated code into regions, each of
+ * which becomes a translation unit of its own. A region starts
+ * at a subroutine or client entry and collects the basic blocks
+ * reachable from there without following calls, up to a size
+ * limit. This keeps LLVM compile time per unit bounded, and a
+ * newly discovered entry only costs the region it belongs to.
+ */
+#include <set>
+
+#include "libcpu.h"
+#include "tag.h"
+#include "basicblock.h"
+#include "region.h"
+
+/* a region is started by someone calling or entering the code here */
+static inline bool
+is_region_head(cpu_t *cpu, addr_t pc)
+{
+	return !!(get_tag(cpu, pc) & (TAG_SUBROUTINE | TAG_ENTRY));
+}
+
+/*
+ * Collect the intra-procedural successors of the basic block
+ * at 'pc': branch targets, not-taken paths, the code after
+ * calls and traps, and the block we fall into. Call targets
+ * are left alone, they start regions of their own.
+ */
+static void
+region_successors(cpu_t *cpu, addr_t pc, addr_list &succ)
+{
+	for (;;) {
+		tag_t tag, dummy;
+		addr_t new_pc, next_pc;
+
+		tag = get_tag(cpu, pc);
+		tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+
+		if ((tag & TAG_BRANCH) && new_pc != NEW_PC_NONE)
+			succ.push_back(new_pc);
+		if (tag & (TAG_CALL | TAG_CONDITIONAL | TAG_TRAP))
+			succ.push_back(next_pc);
+
+		if (!(tag & TAG_CONTINUE))
+			return;
+
+		pc = next_pc;
+		if (!is_code(cpu, pc))
+			return;
+		if (is_start_of_basicblock(cpu, pc)) {
+			succ.push_back(pc);
+			return;
+		}
+	}
+}
+
+/*
+ * Grow a region from 'head' in breadth first order, taking
+ * blocks out of 'pending' as they are assigned.
+ */
+static void
+region_grow(cpu_t *cpu, addr_t head, std::set<addr_t> &pending,
+	addr_list &region)
+{
+	size_t i;
+
+	pending.erase(head);
+	region.push_back(head);
+
+	for (i = 0; i < region.size() && region.size() < LIMIT_REGION_BBS; i++) {
+		addr_list succ;
+		region_successors(cpu, region[i], succ);
+
+		for (addr_list::const_iterator it = succ.begin(); it != succ.end(); it++) {
+			if (region.size() == LIMIT_REGION_BBS)
+				break;
+			/* already assigned, translated or not a block start */
+			if (pending.find(*it) == pending.end())
+				continue;
+			/* somebody else's subroutine (e.g. a tail call) */
+			if (is_region_head(cpu, *it))
+				continue;
+			pending.erase(*it);
+			region.push_back(*it);
+		}
+	}
+}
+
+void
+cpu_find_regions(cpu_t *cpu, region_list &regions)
+{
+	std::set<addr_t> pending;
+	std::set<addr_t>::const_iterator it;
+	addr_t pc;
+
+	// find all basic blocks that still need to be translated
+	for (pc = next_pending_basicblock(cpu, cpu->code_start); pc != NEW_PC_NONE;
+			pc = next_pending_basicblock(cpu, pc + 1))
+		pending.insert(pc);
+
+	// one region per subroutine or entry point first...
+	it = pending.begin();
+	while (it != pending.end()) {
+		pc = *it;
+		if (!is_region_head(cpu, pc)) {
+			it++;
+			continue;
+		}
+		regions.push_back(addr_list());
+		region_grow(cpu, pc, pending, regions.back());
+		it = pending.upper_bound(pc);
+	}
+
+	// ...then whatever is left, because it was cut off by the
+	// size limit or is only reachable through unknown targets.
+	while (!pending.empty()) {
+		regions.push_back(addr_list());
+		region_grow(cpu, *pending.begin(), pending, regions.back());
+	}
+
+	LOG("regions: %u\n", (unsigned)regions.size());
+}
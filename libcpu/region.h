@@ -0,0 +1,3 @@
+typedef std::vector<addr_list> region_list;
+
+void cpu_find_regions(cpu_t *cpu, region_list &regions);
@@ -0,0 +1,217 @@
+/*
+ * libcpu: shadow.cpp
+ *
+ * Shadow return stack. Translated calls push the guest return
+ * address together with the host basic block that continues
+ * there; a translated return that finds its guest target on top
+ * of the stack branches straight to that block, and only falls
+ * back to the target cache and the dispatch switch otherwise.
+ * Since every call target has a region of its own, the return is
+ * usually in another unit than the call: then it links to the
+ * unit that continues at the return address through its slot.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "link.h"
+#include "shadow.h"
+#include "call.h"
+
+enum {
+	SHADOW_FIELD_PC,
+	SHADOW_FIELD_UNIT,
+	SHADOW_FIELD_BLOCK,
+	SHADOW_FIELD_SLOT
+};
+
+bool
+shadow_enabled(cpu_t *cpu)
+{
+	/* single stepping code always returns to the caller */
+	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))
+		return false;
+	/* host calls have their own return stack */
+	return !call_enabled(cpu);
+}
+
+/* forget all entries; must be done whenever translated code is freed */
+void
+shadow_clear(cpu_t *cpu)
+{
+	for (int i = 0; i < SHADOW_STACK_SIZE; i++) {
+		cpu->shadow_stack[i].pc = NEW_PC_NONE;
+		cpu->shadow_stack[i].unit = NULL;
+		cpu->shadow_stack[i].block = NULL;
+		cpu->shadow_stack[i].slot = NULL;
+	}
+	cpu->shadow_top = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// code generation
+//////////////////////////////////////////////////////////////////////
+
+/* pointer to a field of stack entry 'index' */
+static Value *
+shadow_get_field_pointer(cpu_t *cpu, Value *index, int field, BasicBlock *bb)
+{
+	// - struct { addr_t pc; void *unit; void *block; void **slot; }
+	std::vector<Type*> type_entry_fields;
+	type_entry_fields.push_back(getIntegerType(64));
+	type_entry_fields.push_back(PointerType::get(getIntegerType(8), 0));
+	type_entry_fields.push_back(PointerType::get(getIntegerType(8), 0));
+	type_entry_fields.push_back(PointerType::get(getIntegerType(8), 0));
+	StructType *type_entry = StructType::get(_CTX(), type_entry_fields);
+
+	std::vector<Value*> indices;
+	indices.push_back(index);
+	indices.push_back(ConstantInt::get(XgetType(Int32Ty), field));
+	return GetElementPtrInst::Create(
+		get_host_pointer(cpu, cpu->shadow_stack, type_entry),
+		indices, "", bb);
+}
+
+static Value *
+shadow_get_unit(cpu_t *cpu)
+{
+	return ConstantExpr::getBitCast(cpu->cur_func, PointerType::get(getIntegerType(8), 0));
+}
+
+/* called before a unit is translated */
+void
+shadow_begin(cpu_t *cpu)
+{
+	cpu->shadow_ret_bbs.clear();
+	cpu->shadow_sites.clear();
+}
+
+/*
+ * called after a unit is translated: every return site can
+ * branch to every block the unit has pushed.
+ */
+void
+shadow_finish(cpu_t *cpu)
+{
+	std::vector<IndirectBrInst*>::const_iterator i;
+	std::vector<BasicBlock*>::const_iterator j;
+
+	for (i = cpu->shadow_sites.begin(); i != cpu->shadow_sites.end(); i++) {
+		IndirectBrInst *ib = *i;
+		if (cpu->shadow_ret_bbs.empty()) {
+			/* nothing was pushed, so this can't be a hit */
+			BasicBlock *bb = ib->getParent();
+			ib->eraseFromParent();
+			new UnreachableInst(_CTX(), bb);
+			continue;
+		}
+		for (j = cpu->shadow_ret_bbs.begin(); j != cpu->shadow_ret_bbs.end(); j++)
+			ib->addDestination(*j);
+	}
+
+	shadow_begin(cpu);
+}
+
+/* a call that returns to 'ret_pc' */
+void
+emit_shadow_push(cpu_t *cpu, addr_t ret_pc, BasicBlock *bb)
+{
+	PointerType *type_pi8 = PointerType::get(getIntegerType(8), 0);
+	bbaddr_map &bb_addr = cpu->func_bb[cpu->cur_func];
+	bbaddr_map::const_iterator it = bb_addr.find(ret_pc);
+	Value *unit, *block;
+
+	if (it != bb_addr.end()) {
+		unit = shadow_get_unit(cpu);
+		block = BlockAddress::get(cpu->cur_func, it->second);
+		if (std::find(cpu->shadow_ret_bbs.begin(), cpu->shadow_ret_bbs.end(),
+				it->second) == cpu->shadow_ret_bbs.end())
+			cpu->shadow_ret_bbs.push_back(it->second);
+	} else {
+		/* returns to another unit, through the slot */
+		unit = ConstantPointerNull::get(type_pi8);
+		block = ConstantPointerNull::get(type_pi8);
+	}
+	Value *slot = get_host_pointer(cpu, link_get_slot(cpu, ret_pc), getIntegerType(8));
+
+	Value *ptr_top = get_host_pointer(cpu, &cpu->shadow_top, getIntegerType(32));
+	Value *top = new LoadInst(ptr_top, "", false, bb);
+	top = BinaryOperator::Create(Instruction::Add, top, ConstantInt::get(XgetType(Int32Ty), 1), "", bb);
+	top = BinaryOperator::Create(Instruction::And, top, ConstantInt::get(XgetType(Int32Ty), SHADOW_STACK_SIZE - 1), "", bb);
+	new StoreInst(top, ptr_top, false, bb);
+
+	new StoreInst(ConstantInt::get(getIntegerType(64), ret_pc),
+		shadow_get_field_pointer(cpu, top, SHADOW_FIELD_PC, bb), false, bb);
+	new StoreInst(unit, shadow_get_field_pointer(cpu, top, SHADOW_FIELD_UNIT, bb), false, bb);
+	new StoreInst(block, shadow_get_field_pointer(cpu, top, SHADOW_FIELD_BLOCK, bb), false, bb);
+	new StoreInst(slot, shadow_get_field_pointer(cpu, top, SHADOW_FIELD_SLOT, bb), false, bb);
+}
+
+/* a return that is known to match the top entry, see trace.cpp */
+void
+emit_shadow_pop(cpu_t *cpu, BasicBlock *bb)
+{
+	Value *ptr_top = get_host_pointer(cpu, &cpu->shadow_top, getIntegerType(32));
+	Value *top = new LoadInst(ptr_top, "", false, bb);
+	top = BinaryOperator::Create(Instruction::Sub, top, ConstantInt::get(XgetType(Int32Ty), 1), "", bb);
+	top = BinaryOperator::Create(Instruction::And, top, ConstantInt::get(XgetType(Int32Ty), SHADOW_STACK_SIZE - 1), "", bb);
+	new StoreInst(top, ptr_top, false, bb);
+}
+
+/*
+ * Create the basic block a return at 'pc' jumps to once it has
+ * stored the new PC: pop the shadow stack, and if it matches,
+ * continue in the pushed block, or link to the unit that can be
+ * entered at the return address. Continue in 'bb_miss' if not.
+ */
+BasicBlock *
+create_shadow_ret_basicblock(cpu_t *cpu, addr_t pc, BasicBlock *bb_miss)
+{
+	PointerType *type_pfunc = cpu->cur_func->getType();
+	BasicBlock *bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_RETURN);
+	BasicBlock *bb_match = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_RETURN);
+	BasicBlock *bb_hit = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_RETURN);
+	BasicBlock *bb_other = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_RETURN);
+
+	Value *ptr_top = get_host_pointer(cpu, &cpu->shadow_top, getIntegerType(32));
+	Value *top = new LoadInst(ptr_top, "", false, bb);
+	Value *entry_pc = new LoadInst(shadow_get_field_pointer(cpu, top, SHADOW_FIELD_PC, bb), "", false, bb);
+	Value *entry_unit = new LoadInst(shadow_get_field_pointer(cpu, top, SHADOW_FIELD_UNIT, bb), "", false, bb);
+
+	// pop, whether it matches or not
+	Value *new_top = BinaryOperator::Create(Instruction::Sub, top, ConstantInt::get(XgetType(Int32Ty), 1), "", bb);
+	new_top = BinaryOperator::Create(Instruction::And, new_top, ConstantInt::get(XgetType(Int32Ty), SHADOW_STACK_SIZE - 1), "", bb);
+	new StoreInst(new_top, ptr_top, false, bb);
+
+	Value *v_pc = CastInst::CreateZExtOrBitCast(new LoadInst(cpu->ptr_PC, "", false, bb), getIntegerType(64), "", bb);
+	Value *match = new ICmpInst(*bb, ICmpInst::ICMP_EQ, entry_pc, v_pc, "");
+	BranchInst::Create(bb_match, bb_miss, match, bb);
+
+	// blockaddresses are only valid inside the unit that pushed them
+	Value *same = new ICmpInst(*bb_match, ICmpInst::ICMP_EQ, entry_unit, shadow_get_unit(cpu), "");
+	BranchInst::Create(bb_hit, bb_other, same, bb_match);
+
+	Value *block = new LoadInst(shadow_get_field_pointer(cpu, top, SHADOW_FIELD_BLOCK, bb_hit), "", false, bb_hit);
+	cpu->shadow_sites.push_back(IndirectBrInst::Create(block, 0, bb_hit));
+
+	// another unit: link there if it's translated
+	Value *slot = new LoadInst(shadow_get_field_pointer(cpu, top, SHADOW_FIELD_SLOT, bb_other), "", false, bb_other);
+	slot = new BitCastInst(slot, PointerType::getUnqual(type_pfunc), "", bb_other);
+	Value *fp = new LoadInst(slot, "", false, bb_other);
+	new StoreInst(fp, cpu->ptr_link_fp, false, bb_other);
+	Value *linked = new ICmpInst(*bb_other, ICmpInst::ICMP_NE, fp,
+		ConstantPointerNull::get(type_pfunc), "");
+	BranchInst::Create(cpu->bb_link, bb_miss, linked, bb_other);
+
+	return bb;
+}
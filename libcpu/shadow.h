@@ -0,0 +1,7 @@
+bool shadow_enabled(cpu_t *cpu);
+void shadow_clear(cpu_t *cpu);
+void shadow_begin(cpu_t *cpu);
+void shadow_finish(cpu_t *cpu);
+void emit_shadow_push(cpu_t *cpu, addr_t ret_pc, BasicBlock *bb);
+void emit_shadow_pop(cpu_t *cpu, BasicBlock *bb);
+BasicBlock *create_shadow_ret_basicblock(cpu_t *cpu, addr_t pc, BasicBlock *bb_miss);
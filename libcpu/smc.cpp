@@ -0,0 +1,235 @@
+/*
+ * libcpu: smc.cpp
+ *
+ * Self modifying code detection (CPU_CODEGEN_SMC). Every page of
+ * the code area counts the translated ranges that touch it. With
+ * SMC detection on, guest stores look up the page they write to,
+ * and a write to a page with translated code widens the pending
+ * range [smc_lo, smc_hi) instead of branching. Translated code
+ * checks that range after instructions that store, on their fall
+ * through and their branches alike, and before it links to another
+ * unit, and returns to cpu_run(), which then invalidates the
+ * translations the write has hit.
+ */
+#include <assert.h>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "tag.h"
+#include "smc.h"
+
+#define SMC_PAGE_SIZE (1 << SMC_PAGE_SHIFT)
+
+bool
+smc_enabled(cpu_t *cpu)
+{
+	return !!(cpu->flags_codegen & CPU_CODEGEN_SMC);
+}
+
+static void
+smc_reset_pending(cpu_t *cpu)
+{
+	cpu->smc_lo = (addr_t)-1;
+	cpu->smc_hi = 0;
+}
+
+void
+smc_init(cpu_t *cpu)
+{
+	cpu->smc_pages = NULL;
+	cpu->smc_page_count = 0;
+	cpu->smc_stores = false;
+	smc_reset_pending(cpu);
+}
+
+void
+smc_done(cpu_t *cpu)
+{
+	free(cpu->smc_pages);
+	cpu->smc_pages = NULL;
+}
+
+/*
+ * The page counters are allocated once the code area is known and
+ * never move, so translated code can refer to them directly.
+ * There is always one page more than needed, which stores to
+ * addresses outside the code area look at, and which stays 0.
+ */
+static uint32_t *
+smc_get_pages(cpu_t *cpu)
+{
+	if (cpu->smc_pages == NULL) {
+		cpu->smc_page_count = (cpu->code_end - cpu->code_start + SMC_PAGE_SIZE - 1) >> SMC_PAGE_SHIFT;
+		cpu->smc_pages = (uint32_t *)calloc(cpu->smc_page_count + 1, sizeof(uint32_t));
+		assert(cpu->smc_pages != NULL);
+	}
+	return cpu->smc_pages;
+}
+
+static void
+smc_count_range(cpu_t *cpu, addr_t start, addr_t end, int delta)
+{
+	uint32_t *pages = smc_get_pages(cpu);
+
+	if (start < cpu->code_start)
+		start = cpu->code_start;
+	if (end > cpu->code_end)
+		end = cpu->code_end;
+	if (start >= end)
+		return;
+
+	uint32_t first = (start - cpu->code_start) >> SMC_PAGE_SHIFT;
+	uint32_t last = (end - 1 - cpu->code_start) >> SMC_PAGE_SHIFT;
+	for (uint32_t i = first; i <= last; i++)
+		pages[i] += delta;
+}
+
+/* guest code [start, end) has been translated */
+void
+smc_add_range(cpu_t *cpu, addr_t start, addr_t end)
+{
+	smc_count_range(cpu, start, end, 1);
+}
+
+/* the translation of [start, end) has been freed */
+void
+smc_remove_range(cpu_t *cpu, addr_t start, addr_t end)
+{
+	smc_count_range(cpu, start, end, -1);
+}
+
+/* all translations have been freed */
+void
+smc_clear(cpu_t *cpu)
+{
+	if (cpu->smc_pages != NULL)
+		memset(cpu->smc_pages, 0, (cpu->smc_page_count + 1) * sizeof(uint32_t));
+	smc_reset_pending(cpu);
+}
+
+bool
+smc_pending(cpu_t *cpu)
+{
+	return cpu->smc_lo < cpu->smc_hi;
+}
+
+/* called by cpu_run() when no translated code runs */
+void
+smc_invalidate_pending(cpu_t *cpu)
+{
+	addr_t start = cpu->smc_lo, end = cpu->smc_hi;
+
+	smc_reset_pending(cpu);
+	LOG("SMC: invalidating [%llx, %llx)\n", (unsigned long long)start, (unsigned long long)end);
+	cpu_invalidate_range(cpu, start, end);
+}
+
+//////////////////////////////////////////////////////////////////////
+// code generation
+//////////////////////////////////////////////////////////////////////
+
+/*
+ * A store of 'bytes' bytes to guest address 'a': if the page has
+ * translated code, add the bytes to the pending range. This is
+ * branch free, so stores to data pages cost a few instructions.
+ */
+void
+emit_smc_store_check(cpu_t *cpu, Value *a, uint32_t bytes, BasicBlock *bb)
+{
+	IntegerType *type_i64 = getIntegerType(64);
+	IntegerType *type_i32 = getIntegerType(32);
+	uint32_t *pages;
+
+	if (!smc_enabled(cpu))
+		return;
+	cpu->smc_stores = true;
+	pages = smc_get_pages(cpu);
+
+	Value *v_a = CastInst::CreateZExtOrBitCast(a, type_i64, "", bb);
+	Value *v_off = BinaryOperator::Create(Instruction::Sub, v_a,
+		ConstantInt::get(type_i64, cpu->code_start), "", bb);
+	Value *v_inside = new ICmpInst(*bb, ICmpInst::ICMP_ULT, v_off,
+		ConstantInt::get(type_i64, cpu->code_end - cpu->code_start), "");
+
+	// outside the code area, look at the spare page
+	Value *v_page = BinaryOperator::Create(Instruction::LShr, v_off,
+		ConstantInt::get(type_i64, SMC_PAGE_SHIFT), "", bb);
+	v_page = SelectInst::Create(v_inside, v_page,
+		ConstantInt::get(type_i64, cpu->smc_page_count), "", bb);
+	Value *v_count = new LoadInst(GetElementPtrInst::Create(
+		get_host_pointer(cpu, pages, type_i32), v_page, "", bb), "", false, bb);
+	Value *v_hit = new ICmpInst(*bb, ICmpInst::ICMP_NE, v_count, ConstantInt::get(type_i32, 0), "");
+
+	// widen [smc_lo, smc_hi)
+	Value *ptr_lo = get_host_pointer(cpu, &cpu->smc_lo, type_i64);
+	Value *ptr_hi = get_host_pointer(cpu, &cpu->smc_hi, type_i64);
+	Value *v_end = BinaryOperator::Create(Instruction::Add, v_a, ConstantInt::get(type_i64, bytes), "", bb);
+	Value *v_lo = new LoadInst(ptr_lo, "", false, bb);
+	Value *v_hi = new LoadInst(ptr_hi, "", false, bb);
+	Value *v_new_lo = SelectInst::Create(new ICmpInst(*bb, ICmpInst::ICMP_ULT, v_a, v_lo, ""), v_a, v_lo, "", bb);
+	Value *v_new_hi = SelectInst::Create(new ICmpInst(*bb, ICmpInst::ICMP_UGT, v_end, v_hi, ""), v_end, v_hi, "", bb);
+	new StoreInst(SelectInst::Create(v_hit, v_new_lo, v_lo, "", bb), ptr_lo, false, bb);
+	new StoreInst(SelectInst::Create(v_hit, v_new_hi, v_hi, "", bb), ptr_hi, false, bb);
+}
+
+/* end 'bb' with a branch to 'bb_pending' if a code write is pending */
+void
+emit_smc_guard(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_pending, BasicBlock *bb_cont)
+{
+	IntegerType *type_i64 = getIntegerType(64);
+	Value *v_lo = new LoadInst(get_host_pointer(cpu, &cpu->smc_lo, type_i64), "", false, bb);
+	Value *v_hi = new LoadInst(get_host_pointer(cpu, &cpu->smc_hi, type_i64), "", false, bb);
+	Value *v_pending = new ICmpInst(*bb, ICmpInst::ICMP_ULT, v_lo, v_hi, "");
+	BranchInst::Create(bb_pending, bb_cont, v_pending, bb);
+}
+
+/*
+ * A branch at 'pc' to 'bb_target' after an instruction that stored
+ * to memory: returns the block to branch to instead, which leaves
+ * the unit at 'target_pc' on a pending code write (NEW_PC_NONE:
+ * the instruction has set the PC).
+ */
+BasicBlock *
+emit_smc_branch(cpu_t *cpu, addr_t pc, addr_t target_pc, BasicBlock *bb_target,
+	BasicBlock *bb_ret)
+{
+	BasicBlock *bb_check = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_SMC);
+	BasicBlock *bb_exit = bb_ret;
+
+	if (target_pc != NEW_PC_NONE) {
+		bb_exit = create_basicblock(cpu, target_pc, cpu->cur_func, BB_TYPE_SMC);
+		emit_store_pc_return(cpu, bb_exit, target_pc, bb_ret);
+	}
+	emit_smc_guard(cpu, bb_check, bb_exit, bb_target);
+	return bb_check;
+}
+
+/*
+ * Called after an instruction has been translated into 'bb': if
+ * it stored to memory, leave the unit at 'next_pc' on a pending
+ * code write. Returns the basic block to continue in; its
+ * branches have been checked by translate_instr() already.
+ */
+BasicBlock *
+emit_smc_exit(cpu_t *cpu, BasicBlock *bb, addr_t next_pc, BasicBlock *bb_ret)
+{
+	bool stores = cpu->smc_stores;
+
+	cpu->smc_stores = false;
+	if (!stores || bb == NULL)
+		return bb;
+
+	BasicBlock *bb_exit = create_basicblock(cpu, next_pc, cpu->cur_func, BB_TYPE_SMC);
+	BasicBlock *bb_cont = create_basicblock(cpu, next_pc, cpu->cur_func, BB_TYPE_SMC);
+	emit_store_pc_return(cpu, bb_exit, next_pc, bb_ret);
+	emit_smc_guard(cpu, bb, bb_exit, bb_cont);
+	return bb_cont;
+}
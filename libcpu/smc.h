@@ -0,0 +1,12 @@
+bool smc_enabled(cpu_t *cpu);
+void smc_init(cpu_t *cpu);
+void smc_done(cpu_t *cpu);
+void smc_add_range(cpu_t *cpu, addr_t start, addr_t end);
+void smc_remove_range(cpu_t *cpu, addr_t start, addr_t end);
+void smc_clear(cpu_t *cpu);
+bool smc_pending(cpu_t *cpu);
+void smc_invalidate_pending(cpu_t *cpu);
+void emit_smc_store_check(cpu_t *cpu, Value *a, uint32_t bytes, BasicBlock *bb);
+void emit_smc_guard(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_pending, BasicBlock *bb_cont);
+BasicBlock *emit_smc_branch(cpu_t *cpu, addr_t pc, addr_t target_pc, BasicBlock *bb_target, BasicBlock *bb_ret);
+BasicBlock *emit_smc_exit(cpu_t *cpu, BasicBlock *bb, addr_t next_pc, BasicBlock *bb_ret);
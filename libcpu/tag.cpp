@@ -7,16 +7,15 @@
  * (conditional, ...) and code flow information (branch
  * target, ...)
  */
+#include <assert.h>
+#include <functional>
+#include <queue>
+#include <vector>
+
 #include "libcpu.h"
 #include "tag.h"
 #include "sha1.h"
 
-/*
- * TODO: on architectures with constant instruction sizes,
- * this shouldn't waste extra tag data for every byte of
- * code memory, but have one tag per instruction location.
- */
-
 #ifdef _WIN32
 #define MAX_PATH 260
 extern "C" __declspec(dllimport) uint32_t __stdcall GetTempPathA(uint32_t nBufferLength, char *lpBuffer);
@@ -36,12 +35,9 @@ get_temp_dir()
 static void
 init_tagging(cpu_t *cpu)
 {
-	addr_t nitems, i;
+	addr_t i;
 
-	nitems = cpu->code_end - cpu->code_start;
-	cpu->tag = (tag_t*)malloc(nitems * sizeof(tag_t));
-	for (i = 0; i < nitems; i++)
-		cpu->tag[i] = TAG_UNKNOWN;
+	cpu->tags_initialized = true;
 
 	if (!(cpu->flags_codegen & CPU_CODEGEN_TAG_LIMIT)) {
 		/* calculate hash of code */
@@ -88,19 +84,342 @@ is_inside_code_area(cpu_t *cpu, addr_t a)
 	return a >= cpu->code_start && a < cpu->code_end;
 }
 
+/*
+ * Tags are kept in pages of TAG_PAGE_SIZE instruction slots, and
+ * a page is only allocated once something in it gets tagged. An
+ * architecture with aligned instructions gets one slot per
+ * possible instruction location instead of one per byte, and
+ * misaligned addresses never have a tag.
+ */
+#define TAG_PAGE_SIZE (1 << TAG_PAGE_SHIFT)
+
+/*
+ * What the frontend has told us about an instruction, so it isn't
+ * decoded again by every pass that looks at it. Only locations
+ * tagged as code have a record, which is dropped whenever TAG_CODE
+ * is cleared or the client flushes the translations, i.e. the code
+ * may have changed.
+ */
+typedef struct decoded_instr {
+	int bytes;       // 0: tag_instr() hasn't been called yet
+	tag_t tag;
+	addr_t new_pc;
+	addr_t next_pc;
+	void *payload;   // from f.decode_instr(), if any
+} decoded_instr_t;
+
+struct tag_page {
+	tag_t tag[TAG_PAGE_SIZE];
+	uint64_t pending[TAG_PAGE_SIZE / 64]; // untranslated basic block starts
+	decoded_instr_t *decoded; // TAG_PAGE_SIZE records, allocated on demand
+};
+
+void
+tag_init(cpu_t *cpu)
+{
+	uint32_t align = cpu->info.instruction_align;
+
+	cpu->tag_shift = 0;
+	while (align > 1) {
+		assert(!(align & 1) && "instruction alignment must be a power of two");
+		align >>= 1;
+		cpu->tag_shift++;
+	}
+	cpu->tags_initialized = false;
+	cpu->tag_page_last = NULL;
+	cpu->tag_budget = 0;
+}
+
+/* get the page and slot of 'a', or return false if it can't be code */
+static inline bool
+tag_slot(cpu_t *cpu, addr_t a, addr_t *key, uint32_t *slot)
+{
+	addr_t i;
+
+	if (!is_inside_code_area(cpu, a))
+		return false;
+	i = a - cpu->code_start;
+	if (i & ((1 << cpu->tag_shift) - 1))
+		return false;
+	i >>= cpu->tag_shift;
+	*key = i >> TAG_PAGE_SHIFT;
+	*slot = i & (TAG_PAGE_SIZE - 1);
+	return true;
+}
+
+static tag_page_t *
+tag_get_page(cpu_t *cpu, addr_t key, bool create)
+{
+	/* tagging and translation walk the code, so this mostly hits */
+	if (cpu->tag_page_last != NULL && cpu->tag_page_last_key == key)
+		return cpu->tag_page_last;
+
+	tagpage_map::const_iterator it = cpu->tag_pages.find(key);
+	tag_page_t *page;
+	if (it != cpu->tag_pages.end()) {
+		page = it->second;
+	} else if (create) {
+		page = (tag_page_t *)calloc(1, sizeof(tag_page_t));
+		assert(page != NULL);
+		cpu->tag_pages[key] = page;
+	} else {
+		return NULL;
+	}
+
+	cpu->tag_page_last_key = key;
+	cpu->tag_page_last = page;
+	return page;
+}
+
+/*
+ * Keep the bitmap of basic blocks that still need to be translated
+ * up to date with the tag in 'slot', so finding them doesn't need
+ * a scan of all tags.
+ */
+static inline void
+update_pending(tag_page_t *page, uint32_t slot)
+{
+	tag_t tag = page->tag[slot];
+	uint64_t bit = 1ULL << (slot & 63);
+
+	if ((tag & TAG_BASICBLOCK_START) && (tag & TAG_CODE) && !(tag & TAG_TRANSLATED))
+		page->pending[slot >> 6] |= bit;
+	else
+		page->pending[slot >> 6] &= ~bit;
+}
+
 void
 or_tag(cpu_t *cpu, addr_t a, tag_t t)
 {
-	if (is_inside_code_area(cpu, a))
-		cpu->tag[a - cpu->code_start] |= t;
+	addr_t key;
+	uint32_t slot;
+
+	if (tag_slot(cpu, a, &key, &slot)) {
+		tag_page_t *page = tag_get_page(cpu, key, true);
+		page->tag[slot] |= t;
+		update_pending(page, slot);
+	}
+}
+
+static void
+free_decoded(cpu_t *cpu, decoded_instr_t *d)
+{
+	if (d->payload != NULL && cpu->f.free_decoded != NULL)
+		cpu->f.free_decoded(cpu, d->payload);
+	d->payload = NULL;
+	d->bytes = 0;
+}
+
+void
+clear_tag(cpu_t *cpu, addr_t a, tag_t t)
+{
+	addr_t key;
+	uint32_t slot;
+	tag_page_t *page;
+
+	if (tag_slot(cpu, a, &key, &slot) && (page = tag_get_page(cpu, key, false))) {
+		page->tag[slot] &= ~t;
+		update_pending(page, slot);
+		if ((t & TAG_CODE) && page->decoded != NULL)
+			free_decoded(cpu, &page->decoded[slot]);
+	}
+}
+
+/* clear 't' in every tag there is */
+void
+clear_all_tags(cpu_t *cpu, tag_t t)
+{
+	for (tagpage_map::const_iterator it = cpu->tag_pages.begin(); it != cpu->tag_pages.end(); it++)
+		for (uint32_t slot = 0; slot < TAG_PAGE_SIZE; slot++) {
+			it->second->tag[slot] &= ~t;
+			update_pending(it->second, slot);
+		}
+}
+
+/*
+ * The code in [start, end) has changed: untag the instructions
+ * there, and those before 'start' whose bytes reach into it, so
+ * they are decoded and tagged again from the new bytes.
+ */
+void
+clear_code_range(cpu_t *cpu, addr_t start, addr_t end)
+{
+	addr_t pc = cpu->code_start;
+
+	if (start > cpu->code_start + TAG_MAX_INSTR_BYTES)
+		pc = start - TAG_MAX_INSTR_BYTES;
+	for (; pc < start; pc++) {
+		decoded_instr_t *d = get_decoded(cpu, pc);
+		int bytes;
+
+		if (d == NULL)
+			continue;
+		bytes = d->bytes;
+		if (bytes == 0) {
+			tag_t tag;
+			addr_t new_pc, next_pc;
+			bytes = cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+		}
+		if (bytes > 0 && pc + bytes > start)
+			clear_tag(cpu, pc, TAG_CODE | TAG_TRANSLATED);
+	}
+	for (pc = start; pc < end; pc++)
+		clear_tag(cpu, pc, TAG_CODE | TAG_TRANSLATED);
+}
+
+/* forget every decoded instruction */
+void
+clear_all_decoded(cpu_t *cpu)
+{
+	for (tagpage_map::const_iterator it = cpu->tag_pages.begin(); it != cpu->tag_pages.end(); it++) {
+		tag_page_t *page = it->second;
+		if (page->decoded == NULL)
+			continue;
+		for (uint32_t slot = 0; slot < TAG_PAGE_SIZE; slot++)
+			free_decoded(cpu, &page->decoded[slot]);
+		free(page->decoded);
+		page->decoded = NULL;
+	}
+}
+
+/* the cache record for 'pc', or NULL if it can't be cached */
+static decoded_instr_t *
+get_decoded(cpu_t *cpu, addr_t pc)
+{
+	addr_t key;
+	uint32_t slot;
+	tag_page_t *page;
+
+	/* nothing but code has a record, see clear_code_range() */
+	if (!tag_slot(cpu, pc, &key, &slot) || !(page = tag_get_page(cpu, key, false)))
+		return NULL;
+	if (!(page->tag[slot] & TAG_CODE))
+		return NULL;
+	if (page->decoded == NULL) {
+		page->decoded = (decoded_instr_t *)calloc(TAG_PAGE_SIZE, sizeof(decoded_instr_t));
+		assert(page->decoded != NULL);
+	}
+	return &page->decoded[slot];
+}
+
+/*
+ * f.tag_instr(), but every instruction in the code area is only
+ * asked about once. Use this instead of calling the frontend.
+ */
+int
+tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *next_pc)
+{
+	decoded_instr_t *d = get_decoded(cpu, pc);
+
+	if (d == NULL)
+		return cpu->f.tag_instr(cpu, pc, tag, new_pc, next_pc);
+
+	if (d->bytes == 0) {
+		d->new_pc = NEW_PC_NONE;
+		d->bytes = cpu->f.tag_instr(cpu, pc, &d->tag, &d->new_pc, &d->next_pc);
+		/* don't remember failures */
+		if (d->bytes <= 0) {
+			int bytes = d->bytes;
+			d->bytes = 0;
+			return bytes;
+		}
+	}
+	*tag = d->tag;
+	*new_pc = d->new_pc;
+	*next_pc = d->next_pc;
+	return d->bytes;
+}
+
+/*
+ * Return the frontend's decoded form of the instruction at 'pc',
+ * as made by f.decode_instr(), or NULL if the frontend has none
+ * or the instruction can't be cached; the frontend has to decode
+ * it itself then. The result is owned by the cache.
+ */
+void *
+get_decoded_instr(cpu_t *cpu, addr_t pc)
+{
+	decoded_instr_t *d;
+
+	if (cpu->f.decode_instr == NULL || (d = get_decoded(cpu, pc)) == NULL)
+		return NULL;
+	if (d->payload == NULL)
+		d->payload = cpu->f.decode_instr(cpu, pc);
+	return d->payload;
+}
+
+static inline int
+ctz64(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	while (!(v & 1)) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * Return the first basic block start at or after 'pc' that hasn't
+ * been translated yet, or NEW_PC_NONE. Unallocated pages are
+ * skipped entirely, empty stretches 64 slots at a time.
+ */
+addr_t
+next_pending_basicblock(cpu_t *cpu, addr_t pc)
+{
+	addr_t i, key;
+	uint32_t w;
+	uint64_t bits;
+
+	if (pc >= cpu->code_end)
+		return NEW_PC_NONE;
+	if (pc < cpu->code_start)
+		pc = cpu->code_start;
+
+	/* first slot at or after pc */
+	i = (pc - cpu->code_start + (1 << cpu->tag_shift) - 1) >> cpu->tag_shift;
+	key = i >> TAG_PAGE_SHIFT;
+	w = (i & (TAG_PAGE_SIZE - 1)) >> 6;
+
+	tagpage_map::const_iterator it = cpu->tag_pages.lower_bound(key);
+	if (it == cpu->tag_pages.end())
+		return NEW_PC_NONE;
+	if (it->first == key) {
+		bits = it->second->pending[w] & (~0ULL << (i & 63));
+	} else {
+		w = 0;
+		bits = it->second->pending[0];
+	}
+
+	for (;;) {
+		while (!bits && ++w < TAG_PAGE_SIZE / 64)
+			bits = it->second->pending[w];
+		if (bits)
+			break;
+		if (++it == cpu->tag_pages.end())
+			return NEW_PC_NONE;
+		w = 0;
+		bits = it->second->pending[0];
+	}
+
+	i = (it->first << TAG_PAGE_SHIFT) + (w << 6) + ctz64(bits);
+	return cpu->code_start + (i << cpu->tag_shift);
 }
 
 /* access functions */
 tag_t
 get_tag(cpu_t *cpu, addr_t a)
 {
-	if (is_inside_code_area(cpu, a))
-		return cpu->tag[a - cpu->code_start];
+	addr_t key;
+	uint32_t slot;
+	tag_page_t *page;
+
+	if (tag_slot(cpu, a, &key, &slot) && (page = tag_get_page(cpu, key, false)))
+		return page->tag[slot];
 	else
 		return TAG_UNKNOWN;
 }
@@ -113,92 +432,142 @@ is_code(cpu_t *cpu, addr_t a)
 
 extern void disasm_instr(cpu_t *cpu, addr_t pc);
 
+/*
+ * The tagger works through a queue of code locations, ordered by
+ * how many calls and branches away from the entry they are, then
+ * by address. This visits nearby code first and keeps the host
+ * stack flat however deep the guest call graph is.
+ */
+typedef std::pair<int, addr_t> tag_item_t; // level, pc
+typedef std::priority_queue<tag_item_t, std::vector<tag_item_t>,
+	std::greater<tag_item_t> > tag_queue_t;
+
 static void
-tag_recursive(cpu_t *cpu, addr_t pc, int level)
+tag_push(cpu_t *cpu, tag_queue_t &queue, addr_t pc, int level)
 {
-	int bytes;
-	tag_t tag;
-	addr_t new_pc, next_pc;
-
 	if ((cpu->flags_codegen & CPU_CODEGEN_TAG_LIMIT)
 	    && level == LIMIT_TAGGING_DFS)
 		return;
+	queue.push(tag_item_t(level, pc));
+}
+
+/*
+ * Tag the code reachable from 'entry', at most 'budget' (0: any
+ * number of) instructions. Returns the number of new instructions.
+ * Whatever is left over is tagged once execution gets there.
+ */
+static uint32_t
+tag_worklist(cpu_t *cpu, addr_t entry, uint32_t budget)
+{
+	tag_queue_t queue;
+	uint32_t count = 0;
 
-	for(;;) {
-		if (!is_inside_code_area(cpu, pc))
-			return;
-		if (is_code(cpu, pc))	/* we have already been here, ignore */
-			return;
+	tag_push(cpu, queue, entry, 0);
+	while (!queue.empty()) {
+		addr_t pc = queue.top().second;
+		int level = queue.top().first;
+		queue.pop();
 
-		if (LOGGING) {
-			LOG("%*s", level, "");
-			disasm_instr(cpu, pc);
-		}
+		/* follow the code until it leaves */
+		for(;;) {
+			tag_t tag;
+			addr_t new_pc, next_pc;
 
-		bytes = cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
-		or_tag(cpu, pc, tag | TAG_CODE);
-
-		if (tag & TAG_CONDITIONAL)
-			or_tag(cpu, next_pc, TAG_AFTER_COND);
-
-		if (tag & TAG_TRAP)	{
-			/* regular trap - no code after it */
-			if (!(cpu->flags_hint & (CPU_HINT_TRAP_RETURNS | CPU_HINT_TRAP_RETURNS_TWICE)))
-				return;
-			/*
-			 * client hints that a trap will likely return,
-			 * so tag code after it (optimization for usermode
-			 * code that makes syscalls)
-			 */
-			or_tag(cpu, next_pc, TAG_AFTER_TRAP);
-			/*
-			 * client hints that a trap will likely return
-			 * - to the next instruction AND
-			 * - to the instruction after that
-			 * OpenBSD on M88K skips an instruction on a trap
-			 * return if there was an error.
-			 */
-			if (cpu->flags_hint & CPU_HINT_TRAP_RETURNS_TWICE) {
-				tag_t dummy1;
-				addr_t next_pc2, dummy2;
-				next_pc2 = next_pc + cpu->f.tag_instr(cpu, next_pc, &dummy1, &dummy2, &dummy2);
-				or_tag(cpu, next_pc2, TAG_AFTER_TRAP);
-				tag_recursive(cpu, next_pc2, level+1);
+			if (!is_inside_code_area(cpu, pc))
+				break;
+			if (is_code(cpu, pc))	/* we have already been here, ignore */
+				break;
+			if (budget != 0 && count == budget) {
+				LOG("tagging budget exhausted at $%02llx\n", (unsigned long long)pc);
+				return count;
 			}
-		}
 
-		if (tag & TAG_CALL) {
-			/* tag subroutine, then continue with next instruction */
-			or_tag(cpu, new_pc, TAG_SUBROUTINE);
-			or_tag(cpu, next_pc, TAG_AFTER_CALL);
-			tag_recursive(cpu, new_pc, level+1);
-		}
+			if (LOGGING) {
+				LOG("%*s", level, "");
+				disasm_instr(cpu, pc);
+			}
 
-		if (tag & TAG_BRANCH) {
-			or_tag(cpu, new_pc, TAG_BRANCH_TARGET);
-			tag_recursive(cpu, new_pc, level+1);
-			if (!(tag & TAG_CONDITIONAL))
-				return;
-		}
+			/* code first, so the cache keeps what the frontend says */
+			or_tag(cpu, pc, TAG_CODE);
+			tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+			or_tag(cpu, pc, tag);
+			count++;
+
+			if (tag & TAG_CONDITIONAL)
+				or_tag(cpu, next_pc, TAG_AFTER_COND);
+
+			if (tag & TAG_TRAP)	{
+				/* regular trap - no code after it */
+				if (!(cpu->flags_hint & (CPU_HINT_TRAP_RETURNS | CPU_HINT_TRAP_RETURNS_TWICE)))
+					break;
+				/*
+				 * client hints that a trap will likely return,
+				 * so tag code after it (optimization for usermode
+				 * code that makes syscalls)
+				 */
+				or_tag(cpu, next_pc, TAG_AFTER_TRAP);
+				/*
+				 * client hints that a trap will likely return
+				 * - to the next instruction AND
+				 * - to the instruction after that
+				 * OpenBSD on M88K skips an instruction on a trap
+				 * return if there was an error.
+				 */
+				if (cpu->flags_hint & CPU_HINT_TRAP_RETURNS_TWICE) {
+					tag_t dummy1;
+					addr_t next_pc2, dummy2;
+					next_pc2 = next_pc + tag_instr(cpu, next_pc, &dummy1, &dummy2, &dummy2);
+					or_tag(cpu, next_pc2, TAG_AFTER_TRAP);
+					tag_push(cpu, queue, next_pc2, level+1);
+				}
+			}
+
+			if (tag & TAG_CALL) {
+				/* tag subroutine, then continue with next instruction */
+				or_tag(cpu, new_pc, TAG_SUBROUTINE);
+				or_tag(cpu, next_pc, TAG_AFTER_CALL);
+				tag_push(cpu, queue, new_pc, level+1);
+			}
 
-		if (tag & TAG_RET)	/* execution ends here, the follwing location is not reached */
-			return;
+			if (tag & TAG_BRANCH) {
+				or_tag(cpu, new_pc, TAG_BRANCH_TARGET);
+				tag_push(cpu, queue, new_pc, level+1);
+				if (!(tag & TAG_CONDITIONAL))
+					break;
+			}
+
+			if (tag & TAG_RET)	/* execution ends here, the follwing location is not reached */
+				break;
 
-		pc = next_pc;
+			pc = next_pc;
+		}
 	}
+	return count;
 }
 
 void
+tag_done(cpu_t *cpu)
+{
+	clear_all_decoded(cpu);
+	for (tagpage_map::const_iterator it = cpu->tag_pages.begin(); it != cpu->tag_pages.end(); it++)
+		free(it->second);
+	cpu->tag_pages.clear();
+	cpu->tag_page_last = NULL;
+}
+
+uint32_t
 tag_start(cpu_t *cpu, addr_t pc)
 {
+	uint32_t count;
+
 	cpu->tags_dirty = true;
 
 	/* for singlestep, we don't need this */
 	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))
-		return;
+		return 0;
 
 	/* initialize data structure on demand */
-	if (!cpu->tag)
+	if (!cpu->tags_initialized)
 		init_tagging(cpu);
 
 	LOG("starting tagging at $%02llx\n", (unsigned long long)pc);
@@ -213,5 +582,7 @@ tag_start(cpu_t *cpu, addr_t pc)
 	}
 
 	or_tag(cpu, pc, TAG_ENTRY); /* client wants to enter the guest code here */
-	tag_recursive(cpu, pc, 0);
+	count = tag_worklist(cpu, pc, cpu->tag_budget);
+	LOG("tagged %u instructions\n", count);
+	return count;
 }
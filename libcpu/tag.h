@@ -25,11 +25,24 @@
 
 #define TAG_UNKNOWN      0	/* unused (or not yet discovered) code or data */
 
+/* any of these starts a basic block, if it's TAG_CODE */
+#define TAG_BASICBLOCK_START (TAG_BRANCH_TARGET | TAG_SUBROUTINE | TAG_AFTER_CALL | \
+	TAG_AFTER_COND | TAG_AFTER_TRAP | TAG_ENTRY)
+
 tag_t get_tag(cpu_t *cpu, addr_t a);
 void or_tag(cpu_t *cpu, addr_t a, tag_t t);
+void clear_tag(cpu_t *cpu, addr_t a, tag_t t);
+void clear_all_tags(cpu_t *cpu, tag_t t);
+void clear_all_decoded(cpu_t *cpu);
+void clear_code_range(cpu_t *cpu, addr_t start, addr_t end);
 bool is_inside_code_area(cpu_t *cpu, addr_t a);
 bool is_code(cpu_t *cpu, addr_t a);
-void tag_start(cpu_t *cpu, addr_t pc);
+int tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *next_pc);
+void *get_decoded_instr(cpu_t *cpu, addr_t pc);
+void tag_init(cpu_t *cpu);
+uint32_t tag_start(cpu_t *cpu, addr_t pc);
+void tag_done(cpu_t *cpu);
+addr_t next_pending_basicblock(cpu_t *cpu, addr_t pc);
 
 /*
  * NEW_PC_NONE states that the destination of a call is unknown.
@@ -0,0 +1,222 @@
+/*
+ * libcpu: trace.cpp
+ *
+ * Superblocks for hot units. When a unit is translated again
+ * with the block counts of its tier 0 code, the hottest blocks
+ * start traces: chains of the successors execution most often
+ * went to, through conditional branches, fall throughs, and
+ * calls of small leaf routines. translate_all() then translates
+ * every trace as one straight line of copied blocks, which can
+ * only be entered at its head; the paths that leave the trace
+ * continue in the ordinary blocks of the unit. Without the side
+ * entries, LLVM can keep registers and flags in SSA values along
+ * the whole trace.
+ */
+#include <algorithm>
+#include <set>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "tag.h"
+#include "basicblock.h"
+#include "shadow.h"
+#include "trace.h"
+
+/* instructions a leaf routine may have to be followed into */
+#define LIMIT_LEAF_INSTRS 32
+
+static uint32_t
+trace_count(const profile_map &profile, addr_t pc)
+{
+	profile_map::const_iterator it = profile.find(pc);
+	return it != profile.end() ? it->second : 0;
+}
+
+/* find the last instruction of the basic block at 'pc' */
+static void
+trace_block_end(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *next_pc)
+{
+	for (;;) {
+		tag_t dummy;
+
+		*tag = get_tag(cpu, pc);
+		tag_instr(cpu, pc, &dummy, new_pc, next_pc);
+		if (!(*tag & TAG_CONTINUE))
+			return;
+		if (!is_code(cpu, *next_pc) || is_start_of_basicblock(cpu, *next_pc))
+			return;
+		pc = *next_pc;
+	}
+}
+
+/* a routine that is a single basic block ending in a plain return */
+static bool
+trace_is_leaf(cpu_t *cpu, addr_t pc)
+{
+	if (!is_code(cpu, pc))
+		return false;
+
+	for (int i = 0; i < LIMIT_LEAF_INSTRS; i++) {
+		tag_t tag, dummy;
+		addr_t new_pc, next_pc;
+
+		tag = get_tag(cpu, pc);
+		tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+		if (!(tag & TAG_CONTINUE))
+			return (tag & (TAG_CALL | TAG_RET | TAG_BRANCH | TAG_TRAP | TAG_CONDITIONAL)) == TAG_RET;
+		pc = next_pc;
+		if (!is_code(cpu, pc) || is_start_of_basicblock(cpu, pc))
+			return false;
+	}
+	return false;
+}
+
+/*
+ * The successor of the block at 'pc' that continues the trace,
+ * or NEW_PC_NONE. '*ret_pc' is where the leaf routine the trace
+ * is in returns to.
+ */
+static addr_t
+trace_next(cpu_t *cpu, addr_t pc, const profile_map &profile, addr_t *ret_pc)
+{
+	tag_t tag;
+	addr_t new_pc, next_pc, succ;
+
+	trace_block_end(cpu, pc, &tag, &new_pc, &next_pc);
+
+	if (tag & TAG_RET) {
+		succ = *ret_pc;
+		*ret_pc = NEW_PC_NONE;
+		return (tag & TAG_CONDITIONAL) ? NEW_PC_NONE : succ;
+	}
+
+	if (tag & TAG_CALL) {
+		if ((tag & TAG_CONDITIONAL) || new_pc == NEW_PC_NONE || *ret_pc != NEW_PC_NONE)
+			return NEW_PC_NONE;
+		if (!trace_is_leaf(cpu, new_pc) || !is_start_of_basicblock(cpu, next_pc))
+			return NEW_PC_NONE;
+		*ret_pc = next_pc;
+		return new_pc;
+	}
+
+	/* a leaf routine has nothing but its return */
+	if (*ret_pc != NEW_PC_NONE)
+		return NEW_PC_NONE;
+
+	if (tag & TAG_BRANCH) {
+		if (new_pc == NEW_PC_NONE)
+			return NEW_PC_NONE;
+		if (!(tag & TAG_CONDITIONAL))
+			return new_pc;
+		/* only follow the side that is taken most of the time */
+		succ = trace_count(profile, new_pc) >= trace_count(profile, next_pc) ? new_pc : next_pc;
+		if ((uint64_t)trace_count(profile, succ) * 2 < trace_count(profile, pc))
+			return NEW_PC_NONE;
+		return succ;
+	}
+
+	if (tag & TAG_CONTINUE)
+		return next_pc;
+	return NEW_PC_NONE;
+}
+
+static void
+trace_grow(cpu_t *cpu, addr_t head, const profile_map &profile,
+	const std::set<addr_t> &heads, trace_t &trace)
+{
+	addr_t pc = head, ret_pc = NEW_PC_NONE;
+
+	trace.bbs.push_back(head);
+	trace.loop = false;
+
+	while (trace.bbs.size() < LIMIT_TRACE_BBS) {
+		pc = trace_next(cpu, pc, profile, &ret_pc);
+		if (pc == NEW_PC_NONE || !is_code(cpu, pc))
+			break;
+		if (pc == head) {
+			trace.loop = true;
+			break;
+		}
+		/* other traces are entered at their heads only */
+		if (heads.count(pc) ||
+				std::find(trace.bbs.begin(), trace.bbs.end(), pc) != trace.bbs.end())
+			break;
+		trace.bbs.push_back(pc);
+	}
+}
+
+/* ties go to the lower address, usually the head of a loop */
+static bool
+hotter(const std::pair<addr_t, uint32_t> &a, const std::pair<addr_t, uint32_t> &b)
+{
+	if (a.second != b.second)
+		return a.second > b.second;
+	return a.first < b.first;
+}
+
+/*
+ * Start traces at the hottest blocks of the region that aren't
+ * in a trace yet; cold blocks aren't worth the copies.
+ */
+void
+trace_find(cpu_t *cpu, const profile_map &profile, trace_list &traces)
+{
+	std::vector<std::pair<addr_t, uint32_t> > blocks(profile.begin(), profile.end());
+	std::set<addr_t> heads, covered;
+
+	std::sort(blocks.begin(), blocks.end(), hotter);
+
+	for (size_t i = 0; i < blocks.size() && traces.size() < LIMIT_TRACES; i++) {
+		if (blocks[i].second == 0 || blocks[i].second < blocks[0].second / 8)
+			break;
+		if (covered.count(blocks[i].first))
+			continue;
+
+		heads.insert(blocks[i].first);
+		traces.push_back(trace_t());
+		trace_grow(cpu, blocks[i].first, profile, heads, traces.back());
+
+		/* a single block is no better than the ordinary one */
+		if (traces.back().bbs.size() == 1 && !traces.back().loop) {
+			heads.erase(blocks[i].first);
+			traces.pop_back();
+			continue;
+		}
+		covered.insert(traces.back().bbs.begin(), traces.back().bbs.end());
+		cpu->traces++;
+		if (traces.back().loop)
+			cpu->loop_traces++;
+		LOG("trace at %08llx: %u blocks%s\n", (unsigned long long)blocks[i].first,
+			(unsigned)traces.back().bbs.size(), traces.back().loop ? ", loop" : "");
+	}
+}
+
+/*
+ * A return at 'pc' inside a trace, which follows a leaf routine
+ * back to 'ret_pc': continue in the trace if the guest returned
+ * there, as it will unless the return address has been changed,
+ * or in 'bb_miss' otherwise.
+ */
+BasicBlock *
+create_trace_ret_basicblock(cpu_t *cpu, addr_t pc, addr_t ret_pc,
+	BasicBlock *bb_hit, BasicBlock *bb_miss)
+{
+	BasicBlock *bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_TRACE);
+	BasicBlock *bb_pop = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_TRACE);
+
+	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb);
+	Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v_pc,
+		ConstantInt::get(getIntegerType(cpu->info.address_size), ret_pc), "");
+	BranchInst::Create(bb_pop, bb_miss, hit, bb);
+
+	/* the call in the trace has pushed the return */
+	if (shadow_enabled(cpu))
+		emit_shadow_pop(cpu, bb_pop);
+	BranchInst::Create(bb_hit, bb_pop);
+
+	return bb;
+}
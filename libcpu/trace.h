@@ -0,0 +1,8 @@
+typedef struct trace {
+	addr_list bbs; // head first
+	bool loop;     // the last block continues at the head
+} trace_t;
+typedef std::vector<trace_t> trace_list;
+
+void trace_find(cpu_t *cpu, const profile_map &profile, trace_list &traces);
+BasicBlock *create_trace_ret_basicblock(cpu_t *cpu, addr_t pc, addr_t ret_pc, BasicBlock *bb_hit, BasicBlock *bb_miss);
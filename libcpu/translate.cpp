@@ -11,6 +11,33 @@
 #include "libcpu.h"
 #include "tag.h"
 #include "basicblock.h"
+#include "shadow.h"
+#include "smc.h"
+
+/*
+ * The branches of an instruction that stored to memory check for
+ * a pending code write first, see smc.cpp; the fall through is
+ * checked by the caller.
+ */
+static void
+smc_check_branches(cpu_t *cpu, addr_t pc, tag_t tag, BasicBlock **bb_target,
+	BasicBlock **bb_next, BasicBlock *bb_ret)
+{
+	addr_t new_pc, next_pc;
+	tag_t dummy;
+
+	if (!cpu->smc_stores || bb_ret == NULL)
+		return;
+
+	tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+	if (tag & TAG_RET) /* translate_instr() sets PC */
+		new_pc = NEW_PC_NONE;
+	if (*bb_target != NULL)
+		*bb_target = emit_smc_branch(cpu, pc, new_pc, *bb_target, bb_ret);
+	if (*bb_next != NULL && (tag & TAG_DELAY_SLOT))
+		*bb_next = emit_smc_branch(cpu, pc, next_pc, *bb_next, bb_ret);
+}
+
 /*
  * returns the basic block where code execution continues, or
  * NULL if the instruction always branches away
@@ -21,10 +48,17 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 	BasicBlock *bb_target,	/* target for branch/call/rey */
 	BasicBlock *bb_trap,	/* target for trap */
 	BasicBlock *bb_next,	/* non-taken for conditional */
+	BasicBlock *bb_ret,	/* leave the unit; NULL: every branch does */
 	BasicBlock *cur_bb)
 {
 	BasicBlock *bb_cond = NULL;
 	BasicBlock *bb_delay = NULL;
+	/* calls tell the shadow stack where they return to */
+	bool push = (tag & TAG_CALL) && shadow_enabled(cpu);
+	addr_t instr_pc = pc;
+	int bytes;
+
+	cpu->smc_stores = false;
 
 	/* create internal basic blocks if needed */
 	if (tag & TAG_CONDITIONAL)
@@ -42,7 +76,10 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 			// bb_cond: instr; delay; goto bb_target;
 			pc += cpu->f.translate_instr(cpu, pc, bb_cond);
 			delay_pc = pc;
-			cpu->f.translate_instr(cpu, pc, bb_cond);
+			bytes = cpu->f.translate_instr(cpu, pc, bb_cond);
+			if (push)
+				emit_shadow_push(cpu, delay_pc + bytes, bb_cond);
+			smc_check_branches(cpu, instr_pc, tag, &bb_target, &bb_next, bb_ret);
 			BranchInst::Create(bb_target, bb_cond);
 			// bb_cond: delay; goto bb_next;
 			cpu->f.translate_instr(cpu, delay_pc, bb_delay);
@@ -50,7 +87,10 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 		} else {
 			// cur_bb:  instr; delay; goto bb_target;
 			pc += cpu->f.translate_instr(cpu, pc, cur_bb);
-			cpu->f.translate_instr(cpu, pc, cur_bb);
+			bytes = cpu->f.translate_instr(cpu, pc, cur_bb);
+			if (push)
+				emit_shadow_push(cpu, pc + bytes, cur_bb);
+			smc_check_branches(cpu, instr_pc, tag, &bb_target, &bb_next, bb_ret);
 			BranchInst::Create(bb_target, cur_bb);
 		}
 		return NULL; /* don't link */
@@ -64,7 +104,10 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 		cur_bb = bb_cond;
 	}
 
-	cpu->f.translate_instr(cpu, pc, cur_bb);
+	bytes = cpu->f.translate_instr(cpu, pc, cur_bb);
+	if (push)
+		emit_shadow_push(cpu, pc + bytes, cur_bb);
+	smc_check_branches(cpu, pc, tag, &bb_target, &bb_next, bb_ret);
 
 	if (tag & (TAG_BRANCH | TAG_CALL | TAG_RET))
 		BranchInst::Create(bb_target, cur_bb);
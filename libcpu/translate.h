@@ -1 +1 @@
-BasicBlock *translate_instr(cpu_t *cpu, addr_t pc, tag_t tag, BasicBlock *bb_target, BasicBlock *bb_trap, BasicBlock *bb_next, BasicBlock *cur_bb);
+BasicBlock *translate_instr(cpu_t *cpu, addr_t pc, tag_t tag, BasicBlock *bb_target, BasicBlock *bb_trap, BasicBlock *bb_next, BasicBlock *bb_ret, BasicBlock *cur_bb);
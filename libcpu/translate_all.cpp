@@ -1,10 +1,12 @@
 /*
  * libcpu: translate_all.cpp
  *
- * This translates all known code by creating basic blocks and
- * filling them with instructions.
+ * This translates all basic blocks of a region by creating basic
+ * blocks and filling them with instructions.
  */
 
+#include <set>
+
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
 
@@ -14,94 +16,210 @@
 #include "disasm.h"
 #include "tag.h"
 #include "translate.h"
+#include "link.h"
+#include "ibtc.h"
+#include "shadow.h"
+#include "codecache.h"
+#include "smc.h"
+#include "profile.h"
+#include "trace.h"
+#include "call.h"
+#include "flags.h"
+
+
+/*
+ * the block control flow goes to at 'pc': the next block of the
+ * trace being translated, if that's 'succ_pc', or the unit's own
+ */
+static BasicBlock *
+target_basicblock(cpu_t *cpu, addr_t pc, addr_t succ_pc, BasicBlock *bb_succ,
+	BasicBlock *bb_ret)
+{
+	if (bb_succ != NULL && pc == succ_pc)
+		return bb_succ;
+	return const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, pc, bb_ret, BB_TYPE_NORMAL));
+}
+
+/*
+ * Translate the guest basic block at 'pc' into 'cur_bb'. Trace
+ * blocks continue in 'bb_succ' where the trace goes on at
+ * 'succ_pc', including the return of a leaf routine.
+ */
+static void
+translate_basicblock(cpu_t *cpu, addr_t pc, BasicBlock *cur_bb,
+	BasicBlock *bb_dispatch, BasicBlock *bb_ret, BasicBlock *bb_trap,
+	addr_t succ_pc, BasicBlock *bb_succ)
+{
+	addr_t start = pc;
+	tag_t tag;
+	BasicBlock *bb_target = NULL, *bb_next = NULL, *bb_cont = NULL;
 
+	LOG("basicblock: L%08llx\n", (unsigned long long)pc);
 
+	do {
+		tag_t dummy1;
+
+		if (LOGGING)
+			disasm_instr(cpu, pc);
+
+		tag = get_tag(cpu, pc);
+
+		/* get address of the following instruction */
+		addr_t new_pc, next_pc;
+		tag_instr(cpu, pc, &dummy1, &new_pc, &next_pc);
+
+		/* get target basic block */
+		if (tag & TAG_RET) {
+			if (cpu->bb_guest_ret != NULL)
+				bb_target = cpu->bb_guest_ret;
+			else
+				bb_target = create_shadow_ret_basicblock(cpu, pc,
+					create_ibtc_basicblock(cpu, pc, bb_dispatch, bb_ret));
+			if (bb_succ != NULL)
+				bb_target = create_trace_ret_basicblock(cpu, pc, succ_pc, bb_succ, bb_target);
+		}
+		if (tag & (TAG_CALL|TAG_BRANCH)) {
+			if (new_pc == NEW_PC_NONE) /* translate_instr() will set PC */
+				bb_target = create_ibtc_basicblock(cpu, pc, bb_dispatch, bb_ret);
+			else
+				bb_target = target_basicblock(cpu, new_pc, succ_pc, bb_succ, bb_ret);
+			/* known calls become host calls, unless a trace follows them */
+			if ((tag & TAG_CALL) && new_pc != NEW_PC_NONE && call_enabled(cpu) &&
+					(bb_succ == NULL || new_pc != succ_pc))
+				bb_target = create_call_basicblock(cpu, pc, new_pc, next_pc,
+					bb_target, bb_dispatch, bb_ret);
+		}
+		/* get not-taken basic block */
+		if (tag & TAG_CONDITIONAL)
+			bb_next = target_basicblock(cpu, next_pc, succ_pc, bb_succ, bb_ret);
+
+		bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, bb_ret, cur_bb);
+		bb_cont = emit_smc_exit(cpu, bb_cont, next_pc, bb_ret);
+
+		pc = next_pc;
+		
+	} while (
+				/* new basic block starts here (and we haven't translated it yet)*/
+				(!is_start_of_basicblock(cpu, pc)) &&
+				/* end of code section */ //XXX no: this is whether it's TAG_CODE
+				is_code(cpu, pc) &&
+				/* last intruction jumped away */
+				bb_cont
+			);
+
+	codecache_add_range(cpu, start, pc);
+
+	/* link with next basic block if there isn't a control flow instr. already */
+	if (bb_cont) {
+		BasicBlock *target = target_basicblock(cpu, pc, succ_pc, bb_succ, bb_ret);
+		LOG("info: linking continue $%04llx!\n", (unsigned long long)pc);
+		BranchInst::Create(target, bb_cont);
+	}
+}
+
+/*
+ * Translate a trace: its head is the unit's block for that
+ * address, the other blocks are copies that branch to each other.
+ */
+static void
+translate_trace(cpu_t *cpu, const trace_t &trace, BasicBlock *bb_dispatch,
+	BasicBlock *bb_ret, BasicBlock *bb_trap)
+{
+	std::vector<BasicBlock *> bbs;
+	size_t i;
+
+	/* only the head has been assigned to this unit */
+	or_tag(cpu, trace.bbs[0], TAG_TRANSLATED);
+	bbs.push_back(cpu->func_bb[cpu->cur_func][trace.bbs[0]]);
+	for (i = 1; i < trace.bbs.size(); i++)
+		bbs.push_back(create_basicblock(cpu, trace.bbs[i], cpu->cur_func, BB_TYPE_TRACE));
+
+	for (i = 0; i < trace.bbs.size(); i++) {
+		addr_t succ_pc = NEW_PC_NONE;
+		BasicBlock *bb_succ = NULL;
+
+		if (i + 1 < trace.bbs.size()) {
+			succ_pc = trace.bbs[i + 1];
+			bb_succ = bbs[i + 1];
+		} else if (trace.loop) {
+			succ_pc = trace.bbs[0];
+			bb_succ = bbs[0];
+		}
+		translate_basicblock(cpu, trace.bbs[i], bbs[i], bb_dispatch,
+			bb_ret, bb_trap, succ_pc, bb_succ);
+	}
+}
+
+/*
+ * Translate a region. With a 'profile' of its earlier tier 0
+ * code, its hot paths become traces, see trace.cpp.
+ */
 BasicBlock *
-cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
+cpu_translate_all(cpu_t *cpu, const addr_list &region, const profile_map *profile,
+	BasicBlock *bb_ret, BasicBlock *bb_trap)
 {
-	// find all instructions that need labels and create basic blocks for them
+	// create basic blocks for all instructions of the region that need labels
 	int bbs = 0;
-	addr_t pc;
-	pc = cpu->code_start;
-	while (pc < cpu->code_end) {
-		// Do not create the basic block if it is already present in some other function.
-		if (is_start_of_basicblock(cpu, pc) && !(get_tag(cpu, pc) & TAG_TRANSLATED)) {
-			create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_NORMAL);
-			bbs++;
-		}
-		pc++;
+	addr_list::const_iterator i;
+	for (i = region.begin(); i != region.end(); i++) {
+		create_basicblock(cpu, *i, cpu->cur_func, BB_TYPE_NORMAL);
+		bbs++;
 	}
 	LOG("bbs: %d\n", bbs);
 
+	flags_analyze(cpu, region);
+	shadow_begin(cpu);
+
 	// create dispatch basicblock
 	BasicBlock* bb_dispatch = BasicBlock::Create(_CTX(), "dispatch", cpu->cur_func, 0);
 	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb_dispatch);
-	SwitchInst* sw = SwitchInst::Create(v_pc, bb_ret, bbs, bb_dispatch);
+	// PCs that aren't in this unit are looked up in the entry table
+	BasicBlock *bb_lookup = create_lookup_basicblock(cpu, bb_ret);
+	SwitchInst* sw = SwitchInst::Create(v_pc, bb_lookup, bbs, bb_dispatch);
+
+	// hot paths first; trace heads are translated as part of their trace
+	std::set<addr_t> heads;
+	if (profile != NULL) {
+		trace_list traces;
+		trace_find(cpu, *profile, traces);
+		for (trace_list::const_iterator t = traces.begin(); t != traces.end(); t++) {
+			translate_trace(cpu, *t, bb_dispatch, bb_ret, bb_trap);
+			heads.insert(t->bbs[0]);
+		}
+	}
+
+	// loops inside tier 0 code make it hot at their heads
+	std::set<addr_t> loop_heads;
+	if (cpu->cur_unit->tier == 0)
+		profile_find_loop_heads(cpu, region, loop_heads);
 
 	// translate basic blocks
 	bbaddr_map &bb_addr = cpu->func_bb[cpu->cur_func];
 	bbaddr_map::const_iterator it;
 	for (it = bb_addr.begin(); it != bb_addr.end(); it++) {
-		pc = it->first;
+		addr_t pc = it->first;
 		BasicBlock *cur_bb = it->second;
 
-		tag_t tag;
-		BasicBlock *bb_target = NULL, *bb_next = NULL, *bb_cont = NULL;
+		// Add dispatch switch case for basic block.
+		ConstantInt* c = ConstantInt::get(getIntegerType(cpu->info.address_size), pc);
+		sw->addCase(c, cur_bb);
+
+		if (heads.count(pc))
+			continue;
 
 		// Tag the function as translated.
 		or_tag(cpu, pc, TAG_TRANSLATED);
 
-		LOG("basicblock: L%08llx\n", (unsigned long long)pc);
+		if (cpu->cur_unit->tier == 0)
+			cur_bb = profile_emit_block_count(cpu, pc, cur_bb,
+				loop_heads.count(pc) != 0, bb_ret);
 
-		// Add dispatch switch case for basic block.
-		ConstantInt* c = ConstantInt::get(getIntegerType(cpu->info.address_size), pc);
-		sw->addCase(c, cur_bb);
+		translate_basicblock(cpu, pc, cur_bb, bb_dispatch, bb_ret, bb_trap,
+			NEW_PC_NONE, NULL);
+	}
 
-		do {
-			tag_t dummy1;
-
-			if (LOGGING)
-				disasm_instr(cpu, pc);
-
-			tag = get_tag(cpu, pc);
-
-			/* get address of the following instruction */
-			addr_t new_pc, next_pc;
-			cpu->f.tag_instr(cpu, pc, &dummy1, &new_pc, &next_pc);
-
-			/* get target basic block */
-			if (tag & TAG_RET)
-				bb_target = bb_dispatch;
-			if (tag & (TAG_CALL|TAG_BRANCH)) {
-				if (new_pc == NEW_PC_NONE) /* translate_instr() will set PC */
-					bb_target = bb_dispatch;
-				else
-					bb_target = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, new_pc, bb_ret, BB_TYPE_NORMAL));
-			}
-			/* get not-taken basic block */
-			if (tag & TAG_CONDITIONAL)
- 				bb_next = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, next_pc, bb_ret, BB_TYPE_NORMAL));
-
-			bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, cur_bb);
-
-			pc = next_pc;
-			
-		} while (
-					/* new basic block starts here (and we haven't translated it yet)*/
-					(!is_start_of_basicblock(cpu, pc)) &&
-					/* end of code section */ //XXX no: this is whether it's TAG_CODE
-					is_code(cpu, pc) &&
-					/* last intruction jumped away */
-					bb_cont
-				);
-
-		/* link with next basic block if there isn't a control flow instr. already */
-		if (bb_cont) {
-			BasicBlock *target = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, pc, bb_ret, BB_TYPE_NORMAL));
-			LOG("info: linking continue $%04llx!\n", (unsigned long long)pc);
-			BranchInst::Create(target, bb_cont);
-		}
-    }
+	shadow_finish(cpu);
+	flags_forget(cpu);
 
 	return bb_dispatch;
 }
@@ -1 +1 @@
-BasicBlock *cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap);
+BasicBlock *cpu_translate_all(cpu_t *cpu, const addr_list &region, const profile_map *profile, BasicBlock *bb_ret, BasicBlock *bb_trap);
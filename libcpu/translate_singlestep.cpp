@@ -14,6 +14,7 @@
 #include "tag.h"
 #include "basicblock.h"
 #include "translate.h"
+#include "codecache.h"
 
 //////////////////////////////////////////////////////////////////////
 // single stepping
@@ -40,7 +41,7 @@ cpu_translate_singlestep(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 	if (LOGGING)
 		disasm_instr(cpu, pc);
 
-	cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+	tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
 
 	/* get target basic block */
 	if ((tag & TAG_RET) || (new_pc == NEW_PC_NONE)) /* translate_instr() will set PC */
@@ -51,7 +52,8 @@ cpu_translate_singlestep(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 	if (tag & TAG_CONDITIONAL)
 		bb_next = create_singlestep_return_basicblock(cpu, next_pc, bb_ret);
 
-	bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, cur_bb);
+	bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, NULL, cur_bb);
+	codecache_add_range(cpu, pc, next_pc);
 
 	/* If it's not a branch, append "store PC & return" to basic block */
 	if (bb_cont)
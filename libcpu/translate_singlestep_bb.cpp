@@ -9,6 +9,8 @@
 #include "disasm.h"
 #include "tag.h"
 #include "translate.h"
+#include "codecache.h"
+#include "smc.h"
 #include "translate_singlestep.h"
 
 BasicBlock *
@@ -28,7 +30,7 @@ cpu_translate_singlestep_bb(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 		if (LOGGING)
 			disasm_instr(cpu, pc);
 
-		cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+		tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
 
 		/* get target basic block */
 		if (tag & TAG_RET)
@@ -47,12 +49,15 @@ cpu_translate_singlestep_bb(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 		if (tag & TAG_CONDITIONAL)
 			bb_next = create_singlestep_return_basicblock(cpu, next_pc, bb_ret);
 
-		bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, cur_bb);
+		bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, bb_ret, cur_bb);
+		bb_cont = emit_smc_exit(cpu, bb_cont, next_pc, bb_ret);
 
 		pc = next_pc;
 		
 	} while (is_inside_code_area(cpu, pc) && /* end of code section */
 			bb_cont); /* last intruction jumped away */
 
+	codecache_add_range(cpu, entry, pc);
+
 	return cur_bb;
 }
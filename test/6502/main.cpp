@@ -50,6 +50,65 @@ void tag_extra_filename(cpu_t *cpu, char *filename) {
 	free(buf);
 }
 
+static cpu_t *stats_cpu;
+
+static void
+print_statistics() {
+	cpu_code_cache_stats_t stats;
+
+	cpu_get_code_cache_stats(stats_cpu, &stats);
+	printf("code cache: %u units, %u entries, %llu bytes\n",
+		stats.units, stats.entries, (unsigned long long)stats.code_size);
+	cpu_print_statistics(stats_cpu);
+}
+
+static void
+usage(char *name) {
+	printf("Usage: %s [options] executable [entries]\n", name);
+	printf("  -O level    optimization level (0-2)\n");
+	printf("  -t entries  optimize code once it is this hot (0: right away)\n");
+	printf("  -b          optimize in the background\n");
+	printf("  -c          call units directly\n");
+	printf("  -l bytes    limit the code cache\n");
+	printf("  -m          translate code again when the guest writes to it\n");
+	printf("  -s          print statistics on exit\n");
+}
+
+/* returns the index of the first argument after the options */
+static int
+parse_options(cpu_t *cpu, int argc, char **argv) {
+	uint32_t codegen = CPU_CODEGEN_OPTIMIZE;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		char *opt = argv[i];
+		if (!strcmp(opt, "-b"))
+			codegen |= CPU_CODEGEN_BACKGROUND;
+		else if (!strcmp(opt, "-c"))
+			codegen |= CPU_CODEGEN_CALLS;
+		else if (!strcmp(opt, "-m"))
+			codegen |= CPU_CODEGEN_SMC;
+		else if (!strcmp(opt, "-s")) {
+			stats_cpu = cpu;
+			atexit(print_statistics); /* cbmbasic exits from CHRIN */
+		} else if (i + 1 < argc && !strcmp(opt, "-O")) {
+			if (cpu_set_opt_level(cpu, strtoul(argv[++i], NULL, 0)) < 0) {
+				printf("Unknown optimization level %s!\n", argv[i]);
+				exit(3);
+			}
+		} else if (i + 1 < argc && !strcmp(opt, "-t"))
+			cpu_set_hot_threshold(cpu, strtoul(argv[++i], NULL, 0));
+		else if (i + 1 < argc && !strcmp(opt, "-l"))
+			cpu_set_code_cache_limit(cpu, strtoul(argv[++i], NULL, 0));
+		else {
+			usage(argv[0]);
+			exit(3);
+		}
+	}
+	cpu_set_flags_codegen(cpu, codegen);
+	return i;
+}
+
 #ifdef __GNUC__
 void __attribute__((noinline))
 breakpoint() {
@@ -89,6 +148,7 @@ main(int argc, char **argv) {
 	char *entries;
 	cpu_t *cpu;
 	uint8_t *RAM;
+	int arg;
 	int singlestep = SINGLESTEP_NONE;
 	int log = 0;
 	int print_ir = 0;
@@ -97,9 +157,8 @@ main(int argc, char **argv) {
 	RAM = (uint8_t*)malloc(ramsize);
 
 	cpu = cpu_new(CPU_ARCH_6502, 0, CPU_6502_BRK_TRAP |
-		CPU_6502_XXX_TRAP | CPU_6502_V_IGNORE);
+		CPU_6502_XXX_TRAP);
 
-	cpu_set_flags_codegen(cpu, CPU_CODEGEN_OPTIMIZE);
 	cpu_set_flags_debug(cpu, 0
 		| (print_ir? CPU_DEBUG_PRINT_IR : 0)
 		| (print_ir? CPU_DEBUG_PRINT_IR_OPTIMIZED : 0)
@@ -110,14 +169,15 @@ main(int argc, char **argv) {
 	cpu_set_ram(cpu, RAM);
 
 /* parameter parsing */
-	if (argc<2) {
-		printf("Usage: %s executable [entries]\n", argv[0]);
+	arg = parse_options(cpu, argc, argv);
+	if (argc<arg+1) {
+		usage(argv[0]);
 		return 0;
 	}
 
-	executable = argv[1];
-	if (argc>=3)
-		entries = argv[2];
+	executable = argv[arg];
+	if (argc>=arg+2)
+		entries = argv[arg+1];
 	else
 		entries = 0;
 
@@ -161,6 +221,7 @@ main(int argc, char **argv) {
 
 	for(;;) {
 		breakpoint();
+		uint16_t pc = PC;
 		int ret = cpu_run(cpu, debug_function);
 		//printf("ret = %d\n", ret);
 		switch (ret) {
@@ -175,7 +236,8 @@ main(int argc, char **argv) {
 						debug_function(cpu);
 						printf("::STEP:: %d\n", step++);
 					}
-					cpu_flush(cpu);
+					/* step it again from the current bytes, they may change */
+					cpu_invalidate_range(cpu, pc, pc + 1);
 				}
 
 //				cpu_print_statistics(cpu);
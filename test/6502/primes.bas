@@ -0,0 +1,9 @@
+10 REM PRIMES
+20 N=5000
+30 DIM F%(N)
+40 FOR I=2 TO N
+50 IF F%(I) THEN 90
+60 PRINT I
+70 IF I*I>N THEN 90
+80 FOR J=I*I TO N STEP I: F%(J)=1: NEXT J
+90 NEXT I
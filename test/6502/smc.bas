@@ -0,0 +1,8 @@
+10 REM SELF-MODIFYING CODE: LDA #1: STA 251: RTS AT $C000
+20 FOR I=0 TO 4: READ B: POKE 49152+I,B: NEXT I
+30 DATA 169,1,133,251,96
+40 FOR K=1 TO 3
+50 FOR L=1 TO 150: SYS 49152: NEXT L
+60 PRINT PEEK(251)
+70 POKE 49153,PEEK(49153)+1
+80 NEXT K
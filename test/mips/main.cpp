@@ -64,6 +64,69 @@ void tag_extra_filename(cpu_t *cpu, char *filename) {
 	free(buf);
 }
 
+static cpu_t *stats_cpu;
+
+static void
+print_statistics() {
+	cpu_code_cache_stats_t stats;
+
+	cpu_get_code_cache_stats(stats_cpu, &stats);
+	printf("code cache: %u units, %u entries, %llu bytes\n",
+		stats.units, stats.entries, (unsigned long long)stats.code_size);
+	cpu_print_statistics(stats_cpu);
+}
+
+static void
+usage(char *name) {
+#ifdef BENCHMARK_FIB
+	printf("Usage: %s [options] executable [start_no] [entries]\n", name);
+#else
+	printf("Usage: %s [options] executable [entries]\n", name);
+#endif
+	printf("  -O level    optimization level (0-2)\n");
+	printf("  -t entries  optimize code once it is this hot (0: right away)\n");
+	printf("  -b          optimize in the background\n");
+	printf("  -c          call units directly\n");
+	printf("  -l bytes    limit the code cache\n");
+	printf("  -m          translate code again when the guest writes to it\n");
+	printf("  -s          print statistics on exit\n");
+}
+
+/* returns the index of the first argument after the options */
+static int
+parse_options(cpu_t *cpu, int argc, char **argv) {
+	uint32_t codegen = CPU_CODEGEN_OPTIMIZE;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		char *opt = argv[i];
+		if (!strcmp(opt, "-b"))
+			codegen |= CPU_CODEGEN_BACKGROUND;
+		else if (!strcmp(opt, "-c"))
+			codegen |= CPU_CODEGEN_CALLS;
+		else if (!strcmp(opt, "-m"))
+			codegen |= CPU_CODEGEN_SMC;
+		else if (!strcmp(opt, "-s")) {
+			stats_cpu = cpu;
+			atexit(print_statistics);
+		} else if (i + 1 < argc && !strcmp(opt, "-O")) {
+			if (cpu_set_opt_level(cpu, strtoul(argv[++i], NULL, 0)) < 0) {
+				printf("Unknown optimization level %s!\n", argv[i]);
+				exit(3);
+			}
+		} else if (i + 1 < argc && !strcmp(opt, "-t"))
+			cpu_set_hot_threshold(cpu, strtoul(argv[++i], NULL, 0));
+		else if (i + 1 < argc && !strcmp(opt, "-l"))
+			cpu_set_code_cache_limit(cpu, strtoul(argv[++i], NULL, 0));
+		else {
+			usage(argv[0]);
+			exit(3);
+		}
+	}
+	cpu_set_flags_codegen(cpu, codegen);
+	return i;
+}
+
 #ifdef __GNUC__
 void __attribute__((noinline))
 breakpoint() {
@@ -135,6 +198,7 @@ main(int argc, char **argv)
 	unsigned long ramsize;
 	char *stack;
 	int i;
+	int arg;
 #ifdef BENCHMARK_FIB
 	int r1, r2;
 	uint64_t t1, t2, t3, t4;
@@ -142,6 +206,7 @@ main(int argc, char **argv)
 #endif
 #ifdef SINGLESTEP
 	int step = 0;
+	addr_t pc;
 #endif
 	ramsize = 5*1024*1024;
 	RAM = (uint8_t*)malloc(ramsize);
@@ -152,34 +217,32 @@ main(int argc, char **argv)
 			);
 
 #ifdef SINGLESTEP
-	cpu_set_flags_codegen(cpu, CPU_CODEGEN_OPTIMIZE);
 	cpu_set_flags_debug(cpu, CPU_DEBUG_SINGLESTEP | CPU_DEBUG_PRINT_IR | CPU_DEBUG_PRINT_IR_OPTIMIZED);
 #else
-//	cpu_set_flags_codegen(cpu, CPU_CODEGEN_NONE);
-	cpu_set_flags_codegen(cpu, CPU_CODEGEN_OPTIMIZE);
 	cpu_set_flags_debug(cpu, CPU_DEBUG_PRINT_IR | CPU_DEBUG_PRINT_IR_OPTIMIZED);
 #endif
 
 	cpu_set_ram(cpu, RAM);
 
 /* parameter parsing */
-	if (argc<2) {
-		printf("Usage: %s executable [entries]\n", argv[0]);
+	arg = parse_options(cpu, argc, argv);
+	if (argc<arg+1) {
+		usage(argv[0]);
 		return 0;
 	}
 
-	executable = argv[1];
+	executable = argv[arg];
 #ifdef BENCHMARK_FIB
-	if (argc >= 3)
-		start_no = atoi(argv[2]);
+	if (argc >= arg+2)
+		start_no = atoi(argv[arg+1]);
 
-	if (argc >= 4)
-		entries = argv[3];
+	if (argc >= arg+3)
+		entries = argv[arg+2];
 	else
 		entries = 0;
 #else
-	if (argc >= 3)
-		entries = argv[2];
+	if (argc >= arg+2)
+		entries = argv[arg+1];
 	else
 		entries = 0;
 #endif
@@ -239,6 +302,7 @@ main(int argc, char **argv)
 	for(step = 0;;) {
 		printf("::STEP:: %d\n", step++);
 
+		pc = PC;
 		cpu_run(cpu, debug_function);
 
 		dump_state(RAM, (reg_mips32_t*)cpu->rf.grf);
@@ -246,7 +310,7 @@ main(int argc, char **argv)
 		if (PC == -1)
 			break;
 
-		cpu_flush(cpu);
+		cpu_invalidate_range(cpu, pc, pc + 4);
 		printf("*** PRESS <ENTER> TO CONTINUE ***\n");
 		getchar();
 	}
@@ -0,0 +1,17 @@
+# runs BASIC programs under every code generation mode of the driver
+# and compares the numbers they print with test/6502/*.out
+
+# run <program> <options>
+run() {
+	(cat test/6502/$1.bas; echo RUN) |
+	build/libcpu/test_6502 $2 test/bin/6502/cbmbasic.bin `cat test/bin/6502/cbmbasic.hints.txt` |
+	tr -d '\r' | sed -n 's/^ *\([0-9][0-9]*\) *$/\1/p' | diff -q test/6502/$1.out - > /dev/null
+}
+
+for opts in "" "-O 0" "-t 0" "-t 100" "-t 100 -b" "-c" "-l 16384" "-m" "-t 100 -b -c -l 16384 -m"; do
+	echo "*** test_6502 $opts"
+	run primes "$opts" || { echo "primes: wrong output"; exit 1; }
+	# it patches code that has been translated (and got hot), see smc.bas
+	run smc "$opts -m" || { echo "smc: wrong output"; exit 1; }
+done
+echo "*** all modes passed"